@@ -0,0 +1,338 @@
+/* Microbenchmarks for memo.c.
+ *
+ * Times counting the lines of a memo file built in memory: the fgetc
+ * loop count_file_lines used to be against count_file_lines, and a
+ * plain loop against count_byte. memo.c is included as is, so the
+ * functions measured are the ones Memo uses.
+ *
+ * Then times ./memo -F over a memo file of a million notes, scanning
+ * the file and with the .memo.tri trigram index. Build and run with
+ * make bench.
+ */
+
+#define main memo_main
+#include "memo.c"
+#undef main
+
+#include <sys/wait.h>
+
+/* Size of the generated memo file and the times it's scanned */
+#define BENCH_SIZE   (64 * 1024 * 1024)
+#define BENCH_ROUNDS 10
+
+/* Notes of the memo file searched with -F and the times it's searched */
+#define BENCH_NOTES         1000000
+#define BENCH_SEARCH_ROUNDS 5
+
+static double bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Fill buf with notes like Memo writes them. Note lengths vary, so
+ * the separators don't fall on the same bytes of each block.
+ *
+ * Returns the count of lines.
+ */
+static size_t bench_fill(char *buf, size_t size)
+{
+	size_t pos = 0;
+	size_t lines = 0;
+
+	while (pos < size) {
+		char line[128];
+		int len;
+
+		len = snprintf(line, sizeof(line),
+			       "%zu\tU\t2020-01-01\tnote %zu %.*s\n",
+			       lines + 1, lines,
+			       (int)(lines * 7 % 60), "the quick brown fox "
+			       "jumps over the lazy dog and keeps running");
+
+		if (pos + len > size)
+			break;
+
+		memcpy(buf + pos, line, len);
+		pos += len;
+		lines++;
+	}
+
+	memset(buf + pos, '\n', size - pos);
+
+	return lines + (size - pos);
+}
+
+
+/* Temporary file holding the memo file for the stdio cases */
+static FILE *bench_fp;
+
+
+/* The line count of the memo file before count_file_lines read it in
+ * blocks.
+ */
+static size_t lines_fgetc(const char *p, size_t len)
+{
+	size_t lines = 0;
+	int ch;
+
+	(void)p;
+	(void)len;
+	rewind(bench_fp);
+
+	while ((ch = fgetc(bench_fp)) != EOF) {
+		if (ch == '\n')
+			lines++;
+	}
+
+	return lines;
+}
+
+
+static size_t lines_count_file_lines(const char *p, size_t len)
+{
+	(void)p;
+	(void)len;
+	rewind(bench_fp);
+
+	/* count_file_lines leaves out the last line */
+	return count_file_lines(bench_fp) + 1;
+}
+
+
+static size_t lines_loop(const char *p, size_t len)
+{
+	size_t lines = 0;
+
+	for (size_t i = 0; i < len; i++)
+		lines += p[i] == '\n';
+
+	return lines;
+}
+
+
+static size_t lines_count_byte(const char *p, size_t len)
+{
+	return count_byte(p, len, '\n');
+}
+
+
+/* Run fn over buf BENCH_ROUNDS times and print the throughput.
+ *
+ * Returns the best time of a round in seconds.
+ */
+static double bench_run(const char *name,
+			size_t (*fn)(const char *, size_t),
+			const char *buf, size_t size, size_t lines)
+{
+	double best = 0;
+
+	for (int i = 0; i < BENCH_ROUNDS; i++) {
+		double start = bench_now();
+		size_t found = fn(buf, size);
+		double took = bench_now() - start;
+
+		if (found != lines) {
+			fprintf(stderr, "%s: found %zu lines, expected %zu\n",
+				name, found, lines);
+			exit(EXIT_FAILURE);
+		}
+
+		if (i == 0 || took < best)
+			best = took;
+	}
+
+	printf("%-16s %8.2f ms %8.0f MiB/s\n", name, best * 1e3,
+	       size / best / (1024 * 1024));
+
+	return best;
+}
+
+
+/* Write a memo file of count notes to path. Each note names a host
+ * of its own, so a search for one host matches a few notes only.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int bench_write_notes(const char *path, size_t count)
+{
+	FILE *fp = fopen(path, "w");
+
+	if (fp == NULL)
+		return -1;
+
+	for (size_t i = 1; i <= count; i++) {
+		fprintf(fp, "%zu\t%c\t20%02zu-%02zu-%02zu\tnote %zu about "
+			"%s host%zu and stuff\n", i, i % 3 ? 'U' : 'D',
+			i % 20, i % 12 + 1, i % 28 + 1, i,
+			i % 2 ? "deploy" : "backup", i * 7919 % count);
+	}
+
+	return fclose(fp) == 0 ? 0 : -1;
+}
+
+
+/* Run ./memo -F regex with HOME set to dir and the output thrown
+ * away.
+ *
+ * Returns the time taken in seconds, or a negative value on failure.
+ */
+static double bench_search(const char *dir, const char *regex)
+{
+	double start = bench_now();
+	int status;
+	pid_t pid = fork();
+
+	if (pid == -1)
+		return -1;
+
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+
+		if (null == -1 || dup2(null, STDOUT_FILENO) == -1)
+			_exit(127);
+
+		setenv("HOME", dir, 1);
+		unsetenv("XDG_CONFIG_HOME");
+		execl("./memo", "memo", "-F", regex, (char *)NULL);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) == 127)
+		return -1;
+
+	return bench_now() - start;
+}
+
+
+/* Time ./memo -F regex in dir BENCH_SEARCH_ROUNDS times after one run
+ * which builds the index if there's one to build, and print the best
+ * time.
+ *
+ * Returns the best time in seconds, or a negative value on failure.
+ */
+static double bench_search_run(const char *name, const char *dir,
+			       const char *regex)
+{
+	double best = bench_search(dir, regex);
+
+	for (int i = 0; i < BENCH_SEARCH_ROUNDS && best >= 0; i++) {
+		double took = bench_search(dir, regex);
+
+		if (took < 0 || took < best)
+			best = took;
+	}
+
+	if (best < 0) {
+		fprintf(stderr, "%s: error running ./memo -F\n", name);
+		return -1;
+	}
+
+	printf("%-16s %8.2f ms\n", name, best * 1e3);
+
+	return best;
+}
+
+
+/* Time -F over a million notes with and without the trigram index.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int bench_trigram_search()
+{
+	static const char *sidecars[] = {
+		".idx", ".words", ".tri", ".aging", ".jnl"
+	};
+	const char *regex = "host4242[0-9]";
+	char dir[64];
+	char memo[96];
+	char conf[96];
+	char path[96];
+	double scan = -1;
+	double indexed = -1;
+	FILE *fp;
+
+	snprintf(dir, sizeof(dir), "/tmp/memo-bench.%ld", (long)getpid());
+	snprintf(memo, sizeof(memo), "%s/.memo", dir);
+	snprintf(conf, sizeof(conf), "%s/.memorc", dir);
+
+	if (mkdir(dir, S_IRWXU) == -1)
+		return -1;
+
+	if (bench_write_notes(memo, BENCH_NOTES) == 0) {
+		printf("-F %s over %d notes, best of %d rounds\n", regex,
+		       BENCH_NOTES, BENCH_SEARCH_ROUNDS);
+
+		scan = bench_search_run("scan", dir, regex);
+		fp = fopen(conf, "w");
+
+		if (fp != NULL) {
+			fputs("SEARCH_INDEX=yes\n", fp);
+			fclose(fp);
+			indexed = bench_search_run(".memo.tri", dir, regex);
+		}
+
+		if (scan > 0 && indexed > 0)
+			printf("%-16s %8.2fx\n", "", scan / indexed);
+	}
+
+	remove(memo);
+	remove(conf);
+
+	for (size_t i = 0; i < sizeof(sidecars) / sizeof(*sidecars); i++) {
+		snprintf(path, sizeof(path), "%s/.memo%s", dir, sidecars[i]);
+		remove(path);
+	}
+
+	rmdir(dir);
+
+	return scan > 0 && indexed > 0 ? 0 : -1;
+}
+
+
+int main()
+{
+	char *buf = malloc(BENCH_SIZE);
+	size_t lines;
+	double base;
+
+	if (buf == NULL) {
+		fprintf(stderr, "malloc failed\n");
+		return EXIT_FAILURE;
+	}
+
+	lines = bench_fill(buf, BENCH_SIZE);
+	bench_fp = tmpfile();
+
+	if (bench_fp == NULL ||
+	    fwrite(buf, 1, BENCH_SIZE, bench_fp) != BENCH_SIZE) {
+		fprintf(stderr, "error writing temporary file\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%d MiB, %zu lines, best of %d rounds\n",
+	       BENCH_SIZE / (1024 * 1024), lines, BENCH_ROUNDS);
+
+	base = bench_run("fgetc", lines_fgetc, buf, BENCH_SIZE, lines);
+	printf("%-16s %8.2fx\n", "",
+	       base / bench_run("count_file_lines", lines_count_file_lines,
+				buf, BENCH_SIZE, lines));
+
+	base = bench_run("loop", lines_loop, buf, BENCH_SIZE, lines);
+	printf("%-16s %8.2fx\n", "",
+	       base / bench_run("count_byte", lines_count_byte, buf,
+				BENCH_SIZE, lines));
+
+	fclose(bench_fp);
+	free(buf);
+
+	if (bench_trigram_search() == -1)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
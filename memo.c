@@ -43,6 +43,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <getopt.h>
 #include <string.h>
 #include <ctype.h>
@@ -50,14 +51,28 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #ifdef _WIN32
+# include <io.h>
 # include <pcreposix.h>
 #else
 # include <regex.h>
 #endif
 #include <sys/stat.h>
+#include <pthread.h>
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/uio.h>
+#endif
+
+/* Newlines are counted 16 or 32 bytes at a time on x86 */
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+# define MEMO_SCAN_X86
+# include <immintrin.h>
+#endif
 
 
 typedef enum {
@@ -81,38 +96,695 @@ typedef enum {
 } NotePart_t;
 
 
+/* Formats of --format. Text is the default, for people to read. Other
+ * formats have a record for each note without colors:
+ *
+ *   jsonl  a JSON object with id, status, date and content per line
+ *   tsv    the fields separated by tabs, a line for each note, tabs
+ *          and backslashes of the content escaped
+ *   tsv0   the fields separated by tabs, a NUL after each note
+ */
+typedef enum {
+	FORMAT_TEXT = 0,
+	FORMAT_JSONL,
+	FORMAT_TSV,
+	FORMAT_TSV0,
+	FORMAT_COUNT
+} OutputFormat_t;
+
+static const char *output_format_names[FORMAT_COUNT] = {
+	"text",
+	"jsonl",
+	"tsv",
+	"tsv0"
+};
+
+/* Escapes of bytes in JSON strings, 'u' is written as \u00XX and 0
+ * is for the bytes written as they are.
+ */
+static const char json_escapes[256] = {
+	['\b'] = 'b', ['\t'] = 't', ['\n'] = 'n', ['\f'] = 'f', ['\r'] = 'r',
+	[0x00] = 'u', [0x01] = 'u', [0x02] = 'u', [0x03] = 'u', [0x04] = 'u',
+	[0x05] = 'u', [0x06] = 'u', [0x07] = 'u', [0x0b] = 'u', [0x0e] = 'u',
+	[0x0f] = 'u', [0x10] = 'u', [0x11] = 'u', [0x12] = 'u', [0x13] = 'u',
+	[0x14] = 'u', [0x15] = 'u', [0x16] = 'u', [0x17] = 'u', [0x18] = 'u',
+	[0x19] = 'u', [0x1a] = 'u', [0x1b] = 'u', [0x1c] = 'u', [0x1d] = 'u',
+	[0x1e] = 'u', [0x1f] = 'u', ['"'] = '"', ['\\'] = '\\'
+};
+
+
+/* With --count notes are only counted and the count is shown at the
+ * end. With --exists nothing is shown, the exit status tells if any
+ * note was found.
+ */
+typedef enum {
+	COUNT_OFF = 0,
+	COUNT_NOTES,
+	COUNT_EXISTS
+} CountMode_t;
+
+
+/* Properties read from ~/.memorc, see get_memo_conf_value. */
+typedef enum {
+	CONF_MEMO_PATH = 0,
+	CONF_USE_COLORS,
+	CONF_LINE_COLOR,
+	CONF_ODD_LINE_COLOR,
+	CONF_MEMO_CONFIRM_DELETE,
+	CONF_MARK_AS_DONE,
+	CONF_SEARCH_INDEX,
+	CONF_COUNT
+} MemoConf_t;
+
+static const char *memo_conf_names[CONF_COUNT] = {
+	"MEMO_PATH",
+	"USE_COLORS",
+	"LINE_COLOR",
+	"ODD_LINE_COLOR",
+	"MEMO_CONFIRM_DELETE",
+	"MARK_AS_DONE",
+	"SEARCH_INDEX"
+};
+
+static char *memo_conf_values[CONF_COUNT];
+static int   memo_conf_loaded = 0;
+static int   memo_conf_exists = 0;
+
+
+/* Escape sequences of even and odd lines, see init_line_palette */
+static struct {
+	int         resolved;
+	const char *color[2];
+	size_t      len[2];
+} line_palette;
+
+#define COLOR_RESET_NEWLINE "\n\033[0m"
+
+
+/* Notes shown are collected here and written to stdout in large
+ * chunks, see output_write.
+ */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+static struct {
+	char   data[OUTPUT_BUFFER_SIZE];
+	size_t len;
+} output_buffer;
+
+
+/* Command line options which modify how notes are searched and
+ * shown, see read_modifier_options.
+ */
+static struct {
+	int match_all;
+	int jobs;
+	int fuzzy;
+	int max_distance;
+	int rank;
+	OutputFormat_t format;
+	CountMode_t count_mode;
+	size_t offset;
+	size_t limit;
+	int has_limit;
+} memo_opts;
+
+/* Notes passed to output: skipped for --offset and shown after that,
+ * or only counted with --count and --exists.
+ */
+static struct {
+	size_t skipped;
+	size_t shown;
+} output_page;
+
+/* Long options without a short option */
+enum {
+	OPT_ANY = 256,
+	OPT_ALL,
+	OPT_FUZZY,
+	OPT_RANK,
+	OPT_FORMAT,
+	OPT_COUNT,
+	OPT_EXISTS,
+	OPT_OFFSET,
+	OPT_LIMIT
+};
+
+
+/* Read-only view of the whole .memo file. On POSIX systems the file
+ * is memory mapped, on Windows it's read to a heap buffer.
+ */
+struct memo_map {
+	char   *data;
+	size_t  size;
+	int     is_mapped;
+	struct stat st;
+};
+
+
+/* A line borrowed from struct memo_map. Not NUL terminated, the
+ * pointer is valid until the map is closed.
+ */
+struct line_view {
+	const char *str;
+	size_t      len;
+};
+
+
+/* A search word compiled for search_term_find. needle is folded to
+ * lower case and skip is the Horspool shift table.
+ */
+struct search_term {
+	const unsigned char *needle;
+	size_t               len;
+	size_t               skip[256];
+};
+
+
+/* Aho-Corasick automaton matching many search words in one pass, see
+ * term_matcher_build. Bytes are mapped to classes, class 0 is for the
+ * bytes which are not in any word. next is the full transition table
+ * of state_count * class_count states.
+ *
+ * output is the nearest state along the failure links, including the
+ * state itself, where a word ends or -1. fail is the failure link.
+ * seen tells the last record where a word ending in the state was
+ * found, it's used when all the words must match.
+ */
+struct term_matcher {
+	unsigned char  class_of[256];
+	int            class_count;
+	int            state_count;
+	int            term_count;
+	int           *next;
+	int           *fail;
+	int           *output;
+	size_t        *seen;
+	size_t         record;
+};
+
+
+/* A note of show_notes_tree and where it is in the memo file */
+struct tree_record {
+	uint32_t packed_date;
+	size_t   offset;
+	size_t   len;
+};
+
+
+/* Fields of a note line, see parse_note. All spans point into the
+ * line.
+ */
+struct note_view {
+	struct line_view line;
+	struct line_view id_str;
+	struct line_view status_str;
+	struct line_view date;
+	struct line_view content;
+	int              id;
+	NoteStatus_t     status;
+	uint32_t         packed_date;
+};
+
+
+/* .memo.idx file format is following:
+ *
+ * struct memo_index_header
+ * uint32_t                  slots[slot_count] record number + 1 by id
+ * struct memo_index_record  records[count]   in the order of memo file
+ *
+ * The index is valid only for the memo file size and modification
+ * time stored to the header. Records are last, so records of appended
+ * notes are appended to the file. slot_count is even to keep the
+ * records aligned and has room for ids of notes added later.
+ */
+#define MEMO_INDEX_MAGIC   "MIDX"
+#define MEMO_INDEX_VERSION 4
+
+/* Slots left free for the ids of notes added after building */
+#define MEMO_INDEX_SPARE_SLOTS 4096
+
+/* Most status changes patched to .memo.idx, see memo_index_restamp */
+#define MEMO_INDEX_MAX_PATCH 64
+
+struct memo_index_header {
+	char     magic[4];
+	uint32_t version;
+	uint64_t memo_size;
+	int64_t  memo_mtime;
+	uint32_t count;
+	uint32_t slot_count;
+};
+
+/* status is the status character of the note or 0 if the note is
+ * malformed.
+ */
+struct memo_index_record {
+	uint64_t offset;
+	uint32_t length;
+	int32_t  id;
+	char     status;
+	char     reserved[7];
+};
+
+/* .memo.jnl file holds status changes being written to the memo file:
+ *
+ * struct memo_journal_header
+ * struct status_change       changes[count]
+ */
+#define MEMO_JOURNAL_MAGIC "MJNL"
+
+struct memo_journal_header {
+	char     magic[4];
+	uint32_t count;
+	uint64_t memo_size;
+	uint32_t checksum;
+	uint32_t reserved;
+};
+
+/* Status character at offset of the memo file changes from old to new */
+struct status_change {
+	uint64_t offset;
+	char     old;
+	char     new;
+	char     reserved[6];
+};
+
+/* .memo.aging watermark: the memo file of this size and modification
+ * time has no notes older than threshold which are not done.
+ */
+#define MEMO_AGING_MAGIC "MAGE"
+
+struct memo_aging_mark {
+	char     magic[4];
+	uint32_t threshold;
+	uint64_t memo_size;
+	int64_t  memo_mtime;
+};
+
+struct memo_index {
+	char   *data;
+	size_t  size;
+	int     is_mapped;
+	const struct memo_index_header *header;
+	const struct memo_index_record *records;
+	const uint32_t *slots;
+};
+
+/* .memo.words file is an inverted index from the words of the notes
+ * to the notes containing them. .memo.tri file is the same for every
+ * three consecutive bytes of the notes:
+ *
+ * struct posting_index_header
+ * struct posting_key          keys[key_count]   sorted by key
+ * char                        key_bytes[key_bytes_size]
+ * uint8_t                     postings[postings_size]
+ *
+ * Postings of a key are the offsets of the notes in the memo file in
+ * ascending order. Each offset is stored as the difference to the
+ * previous one, as a varint of 7 bits per byte. Only the first
+ * indexed_size bytes of the memo file are indexed, notes appended
+ * after that are scanned when searching.
+ */
+#define WORD_INDEX_MAGIC      "MWRD"
+#define TRIGRAM_INDEX_MAGIC   "MTRI"
+#define POSTING_INDEX_VERSION 2
+
+struct posting_index_header {
+	char     magic[4];
+	uint32_t version;
+	uint64_t memo_size;
+	int64_t  memo_mtime;
+	uint64_t indexed_size;
+	uint64_t key_bytes_size;
+	uint64_t postings_size;
+	uint32_t key_count;
+	uint32_t reserved;
+};
+
+struct posting_key {
+	uint64_t postings_offset;
+	uint32_t postings_len;
+	uint32_t count;
+	uint32_t key_offset;
+	uint32_t key_len;
+};
+
+struct posting_index {
+	char   *data;
+	size_t  size;
+	int     is_mapped;
+	const struct posting_index_header *header;
+	const struct posting_key *keys;
+	const char *key_bytes;
+	const unsigned char *postings;
+};
+
+/* A key of posting_builder and its postings coded so far */
+struct posting_entry {
+	uint32_t       key_offset;
+	uint32_t       key_len;
+	uint32_t       hash;
+	uint32_t       count;
+	uint64_t       last;
+	unsigned char *buf;
+	size_t         buf_len;
+	size_t         buf_alloc;
+};
+
+/* Keys and postings collected in memory before they are written to
+ * a posting index file. entries is a hash table of entry_alloc slots,
+ * key bytes are stored to key_bytes.
+ */
+struct posting_builder {
+	struct posting_entry *entries;
+	size_t                entry_alloc;
+	size_t                entry_count;
+	char                 *key_bytes;
+	size_t                key_bytes_len;
+	size_t                key_bytes_alloc;
+};
+
+/* Sorted set of note offsets, see offset_set_merge */
+struct offset_set {
+	uint64_t *offsets;
+	size_t    count;
+};
+
+/* A note kept by rank_notes, order is the count of notes found
+ * before it.
+ */
+struct rank_hit {
+	double           score;
+	size_t           order;
+	struct line_view line;
+};
+
+/* Position of a search word in a note, see rank_score */
+struct rank_pos {
+	size_t pos;
+	size_t word;
+};
+
+/* State of rank_notes. terms are the search words, hits is the heap
+ * of the best limit notes found so far and today is the current date
+ * in days, see date_to_days.
+ */
+struct rank_state {
+	struct search_term *terms;
+	size_t              word_count;
+	struct rank_pos    *pos;
+	size_t              pos_alloc;
+	struct rank_hit    *hits;
+	size_t              hit_count;
+	size_t              hit_alloc;
+	size_t              limit;
+	long                today;
+};
+
+/* Search of --fuzzy, see fuzzy_pattern_compile */
+struct fuzzy_pattern {
+	uint64_t peq[256];
+	size_t   len;
+	int      max_distance;
+};
+
+/* A note found by fuzzy_search_notes */
+struct fuzzy_hit {
+	struct line_view line;
+	int              distance;
+};
+
+/* Predicates of a -q query, in the order of the cost of checking */
+typedef enum {
+	QUERY_STATUS = 0,
+	QUERY_ID,
+	QUERY_DATE,
+	QUERY_TEXT
+} QueryPred_t;
+
+/* mask has a bit set for each status accepted, min and max are the
+ * inclusive range of ids or packed dates and term is the text.
+ */
+struct query_pred {
+	QueryPred_t        type;
+	uint32_t           mask;
+	uint32_t           min;
+	uint32_t           max;
+	struct search_term term;
+};
+
+/* Plan of a -q query, see query_compile */
+struct query {
+	struct query_pred *preds;
+	size_t             count;
+	unsigned char     *folded;
+};
+
+/* Part of the memo file scanned by one thread, see parallel_scan */
+typedef int (*scan_match_fn)(void *ctx, const struct line_view *note);
+
+struct scan_job {
+	pthread_t              thread;
+	int                    inline_run;
+	const struct memo_map *map;
+	size_t                 start;
+	size_t                 end;
+	scan_match_fn          match;
+	void                  *ctx;
+	struct line_view      *hits;
+	size_t                 hit_count;
+	size_t                 hit_alloc;
+	int                    failed;
+};
+
+/* Per thread state of a parallel -f scan */
+struct search_scan {
+	const struct search_term *term;
+	struct term_matcher       matcher;
+	size_t                    word_count;
+};
+
+/* Per thread state of a parallel -F scan */
+struct regexp_scan {
+	regex_t regex;
+	int     error;
+	char   *line;
+	size_t  line_size;
+};
+
+/* Per thread state of a parallel status filter scan */
+struct status_scan {
+	NoteStatus_t status;
+	size_t       lines;
+};
+
+
+
 /* Function declarations */
 static char *read_file_line(FILE *fp);
+static int   memo_map_open(struct memo_map *map);
+static int   memo_map_open_tail(struct memo_map *map, int n);
+static void  memo_map_close(struct memo_map *map);
+static int   memo_map_next_line(const struct memo_map *map, size_t *pos,
+				struct line_view *line);
+static char *line_view_to_string(const struct line_view *line,
+				 char **buffer, size_t *size);
+static ssize_t memo_pread(int fd, void *buf, size_t count, off_t offset);
+static int   get_note_id_from_view(const char *line, size_t len);
+static void  memo_index_stamp(struct memo_index_header *header,
+			      const struct stat *st);
+static int64_t memo_mtime_ns(const struct stat *st);
+static int   memo_index_attach(struct memo_index *idx, const struct stat *st);
+static int   memo_index_build(struct memo_index *idx, const struct stat *st);
+static void  memo_index_save(const struct memo_index *idx);
+static int   memo_index_open(struct memo_index *idx);
+static int   memo_index_load(struct memo_index *idx, const struct stat *st);
+static size_t memo_index_skip(const struct memo_map *map,
+			      NoteStatus_t status, size_t *pos,
+			      size_t *records);
+static void  memo_index_close(struct memo_index *idx);
+static void  memo_index_invalidate();
+static void  memo_index_update(const struct stat *old, const struct stat *new,
+			       off_t offset, size_t len, const char *line);
+static const struct memo_index_record *memo_index_find(
+	const struct memo_index *idx, int id);
+static char *get_note_by_id(int id, off_t *offset, size_t *len);
+static int   splice_memo_file(off_t offset, size_t len, const char *line);
+static ssize_t memo_pwrite(int fd, const void *buf, size_t count, off_t offset);
+static int   memo_fsync(int fd);
+static void  fsync_parent_dir(const char *path);
+static void  memo_index_restamp(const struct stat *old, const struct stat *new,
+				const struct status_change *changes,
+				size_t count);
+static void  memo_index_append(const struct stat *old, const struct stat *new,
+			       const char *notes, size_t len);
+static int   write_status_changes(const struct status_change *changes,
+				  size_t count);
+static void  recover_status_journal();
+static uint32_t status_changes_checksum(const struct status_change *changes,
+					size_t count);
 static int  add_notes_from_stdin();
+static int  append_notes(const char *notes, size_t len);
 static char *get_memo_file_path();
 static char *get_memo_default_path();
 static char *get_memo_conf_path();
 static char *get_temp_memo_path();
-static char *get_memo_conf_value(const char *prop);
+static char *get_memo_sidecar_path(const char *suffix);
+static const char *get_memo_conf_value(MemoConf_t prop);
+static void  load_memo_conf();
 static int   is_valid_date_format(const char *date, int silent_errors);
 static int   file_exists(const char *path);
 static void  remove_content_newlines(char *content);
 static int   add_note(char *content, const char *date);
 static int   replace_note(int id, const char *data);
 static int   get_next_id();
-static char *get_note_date(char *line);
-static int   get_note_id_from_line(const char *line);
+static off_t find_tail_start(int fd, off_t size, int n);
 static char *integer_to_string(int id);
 static int   delete_note(int id);
 static int   show_notes(NoteStatus_t status);
 static int   show_notes_tree();
+static void  sort_tree_records(struct tree_record **records,
+			       struct tree_record **tmp, size_t count);
 static int   count_file_lines(FILE *fp);
-static char  *note_part_replace(NotePart_t part, char *note_line, const char *data);
-static char  *case_strstr(const char *str1, const char *str2);
-static int   search_notes(char *search);
+static const char *scan_byte(const char *p, size_t len, char c);
+static size_t count_byte(const char *p, size_t len, char c);
+static char  *note_part_replace(NotePart_t part, const struct note_view *note,
+				const char *data);
+static unsigned char fold_byte(unsigned char c);
+static void  search_term_compile(struct search_term *term, const char *str,
+				 size_t len, unsigned char *folded);
+static const char *search_term_find(const struct search_term *term,
+				    const char *haystack, size_t len);
+static int   term_matcher_build(struct term_matcher *m,
+			       const unsigned char **words,
+			       const size_t *words_len, size_t count);
+static void  term_matcher_free(struct term_matcher *m);
+static int   term_matcher_match(struct term_matcher *m, const char *text,
+			       size_t len, int match_all);
+static int   posting_builder_add(struct posting_builder *b,
+				const unsigned char *key, size_t len,
+				uint64_t offset);
+static void  posting_builder_free(struct posting_builder *b);
+static int   posting_entry_sort(const void *a, const void *b);
+static int   posting_index_save(struct posting_builder *b, const char *suffix,
+			       const char *magic, const struct stat *st,
+			       uint64_t indexed_size);
+static int   posting_index_open(struct posting_index *pi, const char *suffix,
+			       const char *magic, const struct stat *st);
+static void  posting_index_close(struct posting_index *pi);
+static size_t posting_decode(const struct posting_index *pi,
+			     const struct posting_key *key, uint64_t *offsets);
+static void  posting_index_restamp(const char *suffix, const char *magic,
+				   const struct stat *old,
+				   const struct stat *new);
+static void  search_index_invalidate();
+static int   search_index_enabled();
+static int   is_word_byte(unsigned char c);
+static int   word_index_build(const struct memo_map *map);
+static size_t offsets_sort_unique(uint64_t *offsets, size_t count);
+static int   offset_sort(const void *a, const void *b);
+static int   offset_set_merge(struct offset_set *a, struct offset_set *b,
+			      int intersect);
+static int   word_index_lookup(const struct posting_index *pi,
+			       const unsigned char *piece, size_t len,
+			       struct offset_set *set);
+static int   word_index_word(const struct posting_index *pi,
+			     const unsigned char *word, size_t len,
+			     struct offset_set *set);
+static int   word_index_candidates(const struct posting_index *pi,
+				   const unsigned char **words,
+				   const size_t *words_len, size_t word_count,
+				   int match_all, struct offset_set *result);
+static int   posting_index_load(struct posting_index *pi, const char *suffix,
+			       const char *magic, const struct memo_map *map,
+			       int (*build)(const struct memo_map *map));
+static const struct posting_key *posting_index_find(
+	const struct posting_index *pi, const unsigned char *key, size_t len);
+static int   trigram_index_build(const struct memo_map *map);
+static size_t skip_bracket(const char *re, size_t len, size_t i);
+static size_t regexp_literals(const char *re, unsigned char *buf,
+			      size_t *starts, size_t *lens);
+static int   trigram_index_candidates(const struct posting_index *pi,
+				      const char *re, struct offset_set *result);
+static int   trigram_index_search(const struct memo_map *map, const char *re,
+				  struct offset_set *result, size_t *indexed_end);
+static int   memo_map_line_at(const struct memo_map *map, uint64_t offset,
+			      struct line_view *note);
+static int   search_matches(const struct search_term *term,
+			   struct term_matcher *matcher, size_t word_count,
+			   const struct line_view *note);
+static int   word_index_search(const struct memo_map *map,
+			       const unsigned char **words,
+			       const size_t *words_len, size_t word_count,
+			       struct offset_set *result, size_t *indexed_end);
+static void *scan_job_run(void *arg);
+static int   parallel_scan(const struct memo_map *map, size_t start, int jobs,
+			   scan_match_fn match, void *ctxs, size_t ctx_size,
+			   struct line_view **hits, size_t *hit_count);
+static int   search_scan_match(void *ctx, const struct line_view *note);
+static int   search_notes_parallel(const struct memo_map *map, size_t start,
+				   const struct search_term *term,
+				   const unsigned char **words,
+				   const size_t *words_len, size_t word_count,
+				   int count);
+static int   regexp_scan_match(void *ctx, const struct line_view *note);
+static int   search_regexp_parallel(const struct memo_map *map, size_t start,
+				    const char *regexp, int count);
+static int   status_scan_match(void *ctx, const struct line_view *note);
+static long  date_to_days(uint32_t packed);
+static int   rank_pos_sort(const void *a, const void *b);
+static double rank_score(struct rank_state *r, const struct note_view *note);
+static int   rank_hit_better(const struct rank_hit *a,
+			     const struct rank_hit *b);
+static int   rank_hit_sort(const void *a, const void *b);
+static int   rank_heap_push(struct rank_state *r, const struct rank_hit *hit);
+static int   rank_notes(const struct memo_map *map,
+			const struct search_term *term,
+			struct term_matcher *matcher,
+			const unsigned char **words, const size_t *words_len,
+			size_t word_count);
+static int   search_notes(const char *search);
+static int   fuzzy_pattern_compile(struct fuzzy_pattern *fp, const char *str,
+				   int max_distance);
+static int   fuzzy_distance(const struct fuzzy_pattern *fp, const char *text,
+			    size_t len, int max);
+static int   fuzzy_note_distance(const struct fuzzy_pattern *fp,
+				 const struct line_view *line);
+static int   fuzzy_scan_match(void *ctx, const struct line_view *note);
+static int   fuzzy_hit_add(struct fuzzy_hit **hits, size_t *count,
+			   size_t *alloc, const struct line_view *line,
+			   int distance);
+static int   fuzzy_search_notes(const char *search);
+static int   query_next_term(const char **p, char *key, size_t key_size,
+			     char *op, char *value, size_t *value_len);
+static int   query_narrow_range(const char *op, uint32_t value, uint32_t *min,
+				uint32_t *max);
+static struct query_pred *query_pred_get(struct query *q, QueryPred_t type);
+static int   query_pred_sort(const void *a, const void *b);
+static int   query_compile(struct query *q, const char *str);
+static void  query_free(struct query *q);
+static int   query_match(const struct query *q, const struct line_view *line);
+static int   query_scan_match(void *ctx, const struct line_view *note);
+static int   query_notes(const char *str);
+static int   read_modifier_options(int argc, char *argv[],
+				   const struct option *long_options);
 static int   search_regexp(const char *regexp);
 static const char *export_html(const char *path);
 static const char *export_csv(const char *path);
-static void  output(char *line, int is_odd_line);
-static void  output_default(char *line, int is_odd_line);
-static void  output_undone(char *line, int is_odd_line);
-static void  output_postponed(char *line, int is_odd_line);
-static void  output_without_date(char *line, int is_odd_line);
+static int   write_all(int fd, const char *data, size_t len);
+static void  output_write(const char *data, size_t len);
+static void  output_flush();
+static void  output_json_string(const char *str, size_t len);
+static void  output_tsv_content(const char *str, size_t len,
+				 int nul_only);
+static void  output_record(const char *line, size_t len);
+static void  output(const char *line, size_t len, int is_odd_line);
+static int   output_is_done();
+static int   output_is_skipping();
+static void  output_default(const char *line, size_t len, int is_odd_line);
+static void  output_undone(const char *line, size_t len, int is_odd_line);
+static void  output_postponed(const char *line, size_t len, int is_odd_line);
+static void  output_without_date(const struct note_view *note, int is_odd_line);
 static void  show_latest(int count);
 static FILE *get_memo_file_ptr(char *mode);
 static FILE *get_memo_tmpfile_ptr();
@@ -120,22 +792,48 @@ static void  usage();
 static void  fail(FILE *out, const char *fmt, ...);
 static int   delete_all();
 static void  show_memo_file_path();
-static NoteStatus_t get_note_status(const char *line);
+static NoteStatus_t get_note_status(const char *line, size_t len);
+static char  get_note_status_char(const char *line, size_t len);
+static int   parse_note(const char *line, size_t len, struct note_view *note);
+static void  report_malformed_note(const char *func, const char *line,
+				   size_t len);
 static int   mark_note_status(NoteStatus_t status, int id);
 static void  note_status_replace(char *line, char new, char old);
-static void  mark_as_done(FILE *fp, char *line);
-static void  mark_as_undone(FILE *fp, char *line);
-static void  mark_as_postponed(FILE *fp, char *line);
+static void  mark_as_done(char *line);
+static void  mark_as_undone(char *line);
+static void  mark_as_postponed(char *line);
 static int   mark_old_as_done();
+static uint32_t pack_date(const char *date, size_t len);
+static int   aging_mark_read(struct memo_aging_mark *mark);
+static int   aging_mark_is_fresh(uint32_t threshold, const struct stat *st);
+static void  aging_mark_save(uint32_t threshold, const struct stat *st);
+static void  aging_mark_invalidate();
+static void  aging_mark_restamp(const struct stat *old, const struct stat *new,
+				const char *notes, size_t len);
 static int   organize_note_identifiers();
 static char *get_line_color(int is_odd_line);
-static char *color_to_escape_seq(char *color);
+static void  init_line_palette();
+static char *color_to_escape_seq(const char *color);
 static int  is_odd(int n);
-static void sort_dates_ascend(char *dates[], int date_index);
-static int  int_sort(const void *a , const void *b);
+static char *format_date(uint32_t packed, char *buf);
 
 #define VERSION "1.7.1"
 
+/* Block size used when reading the memo file backwards */
+#define TAIL_BLOCK_SIZE 4096
+
+/* Most threads used for scanning, see -j */
+#define MAX_JOBS 256
+
+/* yyyy-MM-dd and the terminating \0 */
+#define DATE_STR_SIZE 11
+
+/* Longest search of --fuzzy, the pattern is kept in a 64-bit word */
+#define FUZZY_MAX_LEN 64
+
+/* Count of notes shown by --rank without a count */
+#define RANK_DEFAULT 10
+
 
 /* Check if given date is in valid date format.
  * Memo assumes the date format to be yyyy-MM-dd.
@@ -147,18 +845,16 @@ static int  int_sort(const void *a , const void *b);
  */
 static int is_valid_date_format(const char *date, int silent_errors)
 {
-	int d;
-	int m;
-	int y;
-	int ret;
+	uint32_t packed = pack_date(date, strlen(date));
+	uint32_t y = packed / 10000;
+	uint32_t m = packed / 100 % 100;
+	uint32_t d = packed % 100;
 
 	/* contains number of days in each month from jan to dec */
-	int day_count[12] = { 31, 28, 31, 30, 31, 30,
-			      31, 31, 30, 31, 30, 31 };
-
-	ret = sscanf(date, "%04d-%02d-%02d", &y, &m, &d);
+	uint32_t day_count[12] = { 31, 28, 31, 30, 31, 30,
+				   31, 31, 30, 31, 30, 31 };
 
-	if (ret != 3) {
+	if (packed == 0) {
 		if ( !silent_errors)
 			fail(stderr,"%s: invalid date format\n", __func__);
 
@@ -166,11 +862,11 @@ static int is_valid_date_format(const char *date, int silent_errors)
 	}
 
 	/* Leap year check */
-	if (y % 400 == 0 || y % 100 != 0 || y % 4 == 0)
+	if (y % 400 == 0 || (y % 100 != 0 && y % 4 == 0))
 		day_count[1] = 29;
 
 	if (m < 13 && m > 0) {
-		if (d <= day_count[m - 1]) {
+		if (d > 0 && d <= day_count[m - 1]) {
 			return 0;
 		}
 		else {
@@ -189,6 +885,59 @@ static int is_valid_date_format(const char *date, int silent_errors)
 }
 
 
+/* Convert a date in yyyy-MM-dd format, len bytes long, to integer
+ * yyyyMMdd. Packed dates compare the same way as the dates do.
+ *
+ * Returns 0 if the date is not in yyyy-MM-dd format.
+ */
+static uint32_t pack_date(const char *date, size_t len)
+{
+	/* Maximum digits of year, month and day */
+	static const int digits[3] = { 4, 2, 2 };
+	uint32_t part[3] = { 0, 0, 0 };
+	size_t i = 0;
+
+	for (int p = 0; p < 3; p++) {
+		int n = 0;
+
+		if (p > 0) {
+			if (i == len || date[i] != '-')
+				return 0;
+			i++;
+		}
+
+		while (i < len && isdigit((unsigned char)date[i])) {
+			if (++n > digits[p])
+				return 0;
+
+			part[p] = part[p] * 10 + (date[i] - '0');
+			i++;
+		}
+
+		if (n == 0)
+			return 0;
+	}
+
+	if (i != len)
+		return 0;
+
+	return part[0] * 10000 + part[1] * 100 + part[2];
+}
+
+
+/* Convert a packed yyyyMMdd date back to yyyy-MM-dd. buf must have
+ * room for DATE_STR_SIZE bytes. Returns buf.
+ */
+static char *format_date(uint32_t packed, char *buf)
+{
+	snprintf(buf, DATE_STR_SIZE, "%04u-%02u-%02u",
+		 (unsigned)(packed / 10000 % 10000),
+		 (unsigned)(packed / 100 % 100), (unsigned)(packed % 100));
+
+	return buf;
+}
+
+
 /* Functions checks if file exists.
  * This should be more reliable than using access().
  *
@@ -226,8 +975,9 @@ static int file_exists(const char *path)
  */
 static int count_file_lines(FILE *fp)
 {
-	int count = 0;
-	int ch = 0;
+	char buffer[65536];
+	size_t count = 0;
+	size_t ret;
 
 	if (!fp) {
 		fail(stderr,"%s: NULL file pointer\n", __func__);
@@ -235,12 +985,8 @@ static int count_file_lines(FILE *fp)
 	}
 
 	/* Count lines by new line characters */
-	while (!feof(fp)) {
-		ch = fgetc(fp);
-
-		if (ch == '\n')
-			count++;
-	}
+	while ((ret = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+		count += count_byte(buffer, ret, '\n');
 
 
 	/* Go to beginning of the file */
@@ -331,54 +1077,159 @@ static FILE *get_memo_file_ptr(char *mode)
  *
  * Each line is assumed to be the content part of the note.
  *
- * Notes are added to the memo file. Returns -1 on failure, 0 on
- * success.
+ * Notes are added to the memo file. Ids are given sequentially
+ * starting from get_next_id, all notes are formatted to one buffer and
+ * appended to the memo file with a single write. Returns -1 on failure,
+ * 0 on success.
  */
 static int add_notes_from_stdin()
 {
-	/* First get the whole buffer from stdin. Then parse the buffer;
-	 * each note is separated by a new line character in the
-	 * buffer. Call add_note for each line.
-	 */
-	int length = 128;
+	size_t length = 64 * 1024;
+	size_t count = 0;
+	size_t lines = 0;
+	size_t ret;
 	char *buffer = NULL;
-	int count = 0;
-	char ch;
-	char *line = NULL;
+	char *notes = NULL;
+	char note_date[11];
+	time_t t;
+	int id;
 
-	if ((buffer = malloc(sizeof(char) * length)) == NULL) {
+	if ((buffer = malloc(length)) == NULL) {
 		fail(stderr, "%s: malloc failed\n", __func__);
 		return -1;
 	}
 
-	ch = getc(stdin);
+	/* First get the whole buffer from stdin */
+	while ((ret = fread(buffer + count, 1, length - count, stdin)) > 0) {
+		count += ret;
 
-	while (ch != EOF) {
 		if (count == length) {
-			length += 128;
-			if ((buffer = realloc(buffer, length)) == NULL) {
+			char *tmp = realloc(buffer, length * 2);
+
+			if (tmp == NULL) {
 				fail(stderr, "%s realloc failed\n", __func__);
+				free(buffer);
 				return -1;
 			}
+
+			buffer = tmp;
+			length *= 2;
 		}
+	}
 
-		buffer[count] = ch;
-		count++;
-		ch = getc(stdin);
+	lines = count_byte(buffer, count, '\n');
+
+	/* Each note gets id, status and date in front of it: at most
+	 * 11 characters of id, status, date and four separators.
+	 */
+	notes = malloc(count + (lines + 1) * 32);
+
+	if (notes == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		free(buffer);
+		return -1;
 	}
 
-	buffer[count] = '\0';
-	buffer = realloc(buffer, count + 1);
+	id = get_next_id();
+
+	if (id == -1)
+		id = 1;
+
+	time(&t);
+	strftime(note_date, sizeof(note_date), "%Y-%m-%d", localtime(&t));
 
-	line = strtok(buffer, "\n");
+	/* Each note is separated by a new line character in the buffer,
+	 * empty lines are skipped.
+	 */
+	char *out = notes;
+	char *line = buffer;
+	char *end = buffer + count;
+
+	while (line < end) {
+		const char *nl = scan_byte(line, end - line, '\n');
+		size_t len = nl ? (size_t)(nl - line) : (size_t)(end - line);
+
+		if (len > 0) {
+			out += sprintf(out, "%d\tU\t%s\t", id++, note_date);
+			memcpy(out, line, len);
+			out += len;
+			*out++ = '\n';
+		}
 
-	while (line != NULL) {
-		add_note(line, NULL);
-		line = strtok(NULL, "\n");
+		line += len + 1;
 	}
 
 	free(buffer);
 
+	ret = append_notes(notes, out - notes);
+	free(notes);
+
+	return ret == 0 ? 0 : -1;
+}
+
+
+/* Append len bytes of formatted notes to the memo file with one write
+ * and flush the file to disk once.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int append_notes(const char *notes, size_t len)
+{
+	char *path = NULL;
+	struct stat old;
+	struct stat new;
+	size_t done = 0;
+	int fd;
+
+	if (len == 0)
+		return 0;
+
+	path = get_memo_file_path();
+
+	if (path == NULL)
+		return -1;
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	if (fd == -1) {
+		fail(stderr, "%s: error opening %s\n", __func__, path);
+		free(path);
+		return -1;
+	}
+
+	if (fstat(fd, &old) == -1) {
+		fail(stderr, "%s: error reading %s\n", __func__, path);
+		close(fd);
+		free(path);
+		return -1;
+	}
+
+	while (done < len) {
+		ssize_t ret = write(fd, notes + done, len - done);
+
+		if (ret == -1) {
+			fail(stderr, "%s: error writing %s\n", __func__, path);
+			close(fd);
+			free(path);
+			return -1;
+		}
+
+		done += ret;
+	}
+
+	memo_fsync(fd);
+
+	if (fstat(fd, &new) == 0) {
+		aging_mark_restamp(&old, &new, notes, len);
+		memo_index_append(&old, &new, notes, len);
+		posting_index_restamp(".words", WORD_INDEX_MAGIC, &old, &new);
+		posting_index_restamp(".tri", TRIGRAM_INDEX_MAGIC, &old, &new);
+	}
+
+	close(fd);
+	free(path);
+
 	return 0;
 }
 
@@ -438,841 +1289,5460 @@ static char *read_file_line(FILE *fp)
 }
 
 
-/* Simply read all the lines from the .memo file
- * and return the id of the last line plus one.
- * If the file is missing or is empty, return 1
- * On error, returns -1
- */
-static int get_next_id()
+#ifdef MEMO_SCAN_X86
+static size_t count_byte_sse2(const char *p, size_t len, char c)
 {
-	int id = 0;
-	FILE *fp = NULL;
-	char *line = NULL;
-	int lines = 0;
-	int current = 0;
-
-	fp = get_memo_file_ptr("r");
+	const __m128i needle = _mm_set1_epi8(c);
+	size_t count = 0;
+	size_t i = 0;
 
-	lines = count_file_lines(fp);
+	for (; i + 16 <= len; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(p + i));
 
-	if (lines == -1) {
-		fail(stderr,"%s: counting lines failed\n", __func__);
-		return -1;
+		count += __builtin_popcount(
+			_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
 	}
 
-	if (lines == -2) {
-		fclose(fp);
-		return id + 1;
-	}
+	for (; i < len; i++)
+		count += p[i] == c;
 
-	while (1) {
-		line = read_file_line(fp);
+	return count;
+}
 
-		/* Check if we're at the last line */
-		if (line && current == lines) {
-			id = get_note_id_from_line(line);
-			free(line);
-			break;
-		}
 
-		current++;
+__attribute__((target("avx2")))
+static size_t count_byte_avx2(const char *p, size_t len, char c)
+{
+	const __m256i needle = _mm256_set1_epi8(c);
+	size_t count = 0;
+	size_t i = 0;
 
-		if (line)
-			free(line);
-	}
+	for (; i + 32 <= len; i += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *)(p + i));
 
-	fclose(fp);
+		count += __builtin_popcount(_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(block, needle)));
+	}
 
-	return id + 1;
+	return count + count_byte_sse2(p + i, len - i, c);
 }
 
 
-/* Show all notes. with status POSTPONED, postponed
- * notes are shown. With status UNDONE, only undone
- * notes are shown. Otherwise status is ignored and
- * all notes are displayed.
- *
- * Returns the number of notes. Returns -1 on failure
- */
-static int show_notes(NoteStatus_t status)
-{
-	FILE *fp = NULL;
-	char *line;
-	int count = 0;
-	int lines = 0;
+static pthread_once_t scan_cpu_once = PTHREAD_ONCE_INIT;
+static int scan_avx2;
 
-	/* Output count is used to calculate even and odd lines
-	 * when outputting undone or postponed notes.
-	 * When outputting normally, lines is used as the counter.
-	 */
-	int postponed_output_count = 0;
-	int undone_output_count = 0;
 
-	fp = get_memo_file_ptr("r");
+static void scan_detect_cpu()
+{
+	__builtin_cpu_init();
+	scan_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+}
 
-	lines = count_file_lines(fp);
-	count = lines;
 
-	if (lines == -1) {
-		fail(stderr,"%s: counting lines failed\n", __func__);
-		return -1;
-	}
+/* AVX2 is not part of the x86 baseline, so the CPU is asked once.
+ * Scans run on the worker threads too, pthread_once keeps them from
+ * racing on the answer.
+ */
+static int scan_has_avx2()
+{
+	pthread_once(&scan_cpu_once, scan_detect_cpu);
 
-	/* Ignore empty note file and exit */
-	if (lines == -2) {
-		fail(stderr,"You don't have any notes currently.\n", __func__);
-		fclose(fp);
-		return -1;
-	}
+	return scan_avx2;
+}
+#endif
 
-	while (lines >= 0) {
-		line = read_file_line(fp);
 
-		if (line) {
+/* Find the first c in len bytes starting from p. This is the scanner
+ * for the record (newline) and field (tab) separators of the memo
+ * file. The C library memchr is already vectorized where it matters
+ * and beat a scanner of our own, see make bench.
+ *
+ * Returns pointer to the byte or NULL if there is no c.
+ */
+static const char *scan_byte(const char *p, size_t len, char c)
+{
+	return memchr(p, c, len);
+}
 
-			/* status is just used to know what kind of output we want.
-			 * we still need to check status the of the current line
-			 * separately.
-			 */
-			if (status == POSTPONED) {
-				if (get_note_status(line) == POSTPONED) {
-					postponed_output_count++;
-					int odd_p = is_odd(postponed_output_count);
-					output_postponed(line, odd_p);
-				}
-			}
-			else if (status == UNDONE) {
-				if (get_note_status(line) == UNDONE) {
-					undone_output_count++;
-					int odd_u = is_odd(undone_output_count);
-					output_undone(line, odd_u);
-				}
-			}
-			else {
-				output_default(line, is_odd(lines));
-			}
 
-			free(line);
-		}
+/* Count the occurrences of c in len bytes starting from p. Uses AVX2
+ * or SSE2 when available, there's no C library function for this.
+ */
+static size_t count_byte(const char *p, size_t len, char c)
+{
+#ifdef MEMO_SCAN_X86
+	if (scan_has_avx2())
+		return count_byte_avx2(p, len, c);
 
-		lines--;
-	}
+	return count_byte_sse2(p, len, c);
+#else
+	size_t count = 0;
 
-	fclose(fp);
+	for (size_t i = 0; i < len; i++)
+		count += p[i] == c;
 
 	return count;
+#endif
 }
 
 
-/* Function returns the date string of the note.
+/* Maps the .memo file into memory for reading. Lines can then be
+ * walked with memo_map_next_line without copying or allocating them.
  *
- * On success caller must free the return value.
- * NULL is returned on failure.
+ * An empty memo file is not an error, map->size is 0 then.
+ *
+ * Returns 0 on success and -1 on failure. Caller must call
+ * memo_map_close after calling the function successfully.
  */
-static char *get_note_date(char *line)
+static int memo_map_open(struct memo_map *map)
 {
-	char *date = NULL;
-	char *tmpline = strdup(line);
-	char *datetoken = NULL;
+	char *path = NULL;
+	int fd;
 
-	if (tmpline == NULL)
-		return NULL;
+	map->data = NULL;
+	map->size = 0;
+	map->is_mapped = 0;
 
-	datetoken = strtok(tmpline, "\t");
-	datetoken = strtok(NULL, "\t");
-	datetoken = strtok(NULL, "\t");
+	path = get_memo_file_path();
 
-	if (datetoken == NULL) {
-		free(tmpline);
-		return NULL;
+	if (path == NULL) {
+		fail(stderr, "%s: error getting ~/.memo path\n", __func__);
+		return -1;
 	}
 
-	date = malloc((strlen(datetoken) + 1) * sizeof(char));
+	fd = open(path, O_RDONLY);
 
-	if (date == NULL) {
-		free(tmpline);
-		return NULL;
+	if (fd == -1) {
+		fail(stderr, "%s: error opening %s\n", __func__, path);
+		free(path);
+		return -1;
 	}
 
-	strcpy(date, datetoken);
+	free(path);
 
-	free(tmpline);
+	if (fstat(fd, &map->st) == -1) {
+		fail(stderr, "%s: stat failed\n", __func__);
+		close(fd);
+		return -1;
+	}
 
-	return date;
-}
+	if (map->st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	map->size = map->st.st_size;
+
+#ifdef _WIN32
+	map->data = malloc(map->size);
+
+	if (map->data == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		close(fd);
+		return -1;
+	}
+
+	size_t done = 0;
+
+	while (done < map->size) {
+		ssize_t ret = read(fd, map->data + done, map->size - done);
+
+		if (ret <= 0) {
+			fail(stderr, "%s: read failed\n", __func__);
+			free(map->data);
+			close(fd);
+			return -1;
+		}
+
+		done += ret;
+	}
+#else
+	map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map->data == MAP_FAILED) {
+		fail(stderr, "%s: mmap failed\n", __func__);
+		map->data = NULL;
+		close(fd);
+		return -1;
+	}
+
+	map->is_mapped = 1;
+
+	/* Notes are almost always read from start to end */
+	posix_madvise(map->data, map->size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+	close(fd);
+
+	return 0;
+}
+
+
+/* Read the last n lines of the .memo file to a heap buffer, instead of
+ * mapping the whole file like memo_map_open. Blocks are read backwards
+ * from the end with find_tail_start until n lines are found, so the
+ * cost depends on n and not on the size of the file. The map must be
+ * released with memo_map_close as usual.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int memo_map_open_tail(struct memo_map *map, int n)
+{
+	char *path = NULL;
+	off_t start;
+	int fd;
+
+	map->data = NULL;
+	map->size = 0;
+	map->is_mapped = 0;
+
+	path = get_memo_file_path();
+
+	if (path == NULL) {
+		fail(stderr, "%s: error getting ~/.memo path\n", __func__);
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+
+	if (fd == -1) {
+		fail(stderr, "%s: error opening %s\n", __func__, path);
+		free(path);
+		return -1;
+	}
+
+	free(path);
+
+	if (fstat(fd, &map->st) == -1) {
+		fail(stderr, "%s: stat failed\n", __func__);
+		close(fd);
+		return -1;
+	}
+
+	start = find_tail_start(fd, map->st.st_size, n);
+
+	if (start == -1 || start == map->st.st_size) {
+		close(fd);
+		return start == -1 ? -1 : 0;
+	}
+
+	map->size = map->st.st_size - start;
+	map->data = malloc(map->size);
+
+	if (map->data == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		map->size = 0;
+		close(fd);
+		return -1;
+	}
+
+	if (memo_pread(fd, map->data, map->size, start) != (ssize_t)map->size) {
+		fail(stderr, "%s: read failed\n", __func__);
+		memo_map_close(map);
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+
+/* Release the memory mapping created by memo_map_open. */
+static void memo_map_close(struct memo_map *map)
+{
+#ifndef _WIN32
+	if (map->is_mapped)
+		munmap(map->data, map->size);
+	else
+#endif
+		free(map->data);
+
+	map->data = NULL;
+	map->size = 0;
+	map->is_mapped = 0;
+}
+
+
+/* Get the next line of the mapped memo file. *pos is the offset where
+ * reading starts, set it to 0 before the first call. Empty lines are
+ * skipped.
+ *
+ * Returns 1 when line was set and 0 at the end of the file.
+ */
+static int memo_map_next_line(const struct memo_map *map, size_t *pos,
+			      struct line_view *line)
+{
+	while (*pos < map->size) {
+		const char *start = map->data + *pos;
+		size_t left = map->size - *pos;
+		const char *nl = scan_byte(start, left, '\n');
+		size_t len = nl ? (size_t)(nl - start) : left;
+
+		*pos += nl ? len + 1 : len;
+
+		if (len == 0)
+			continue;
+
+		line->str = start;
+		line->len = len;
+
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/* Copy the line to *buffer and terminate it with \0, for functions
+ * which need a C string. *buffer only grows, so repeated calls do not
+ * allocate once the longest line has been seen.
+ *
+ * Returns *buffer, or NULL on failure. Caller is responsible for
+ * freeing *buffer.
+ */
+static char *line_view_to_string(const struct line_view *line,
+				 char **buffer, size_t *size)
+{
+	if (*size < line->len + 1) {
+		char *tmp = realloc(*buffer, line->len + 1);
+
+		if (tmp == NULL) {
+			fail(stderr, "%s: realloc failed\n", __func__);
+			return NULL;
+		}
+
+		*buffer = tmp;
+		*size = line->len + 1;
+	}
+
+	memcpy(*buffer, line->str, line->len);
+	(*buffer)[line->len] = '\0';
+
+	return *buffer;
+}
+
+
+/* pread which also works on Windows, where it's emulated with lseek
+ * and read.
+ */
+static ssize_t memo_pread(int fd, void *buf, size_t count, off_t offset)
+{
+#ifdef _WIN32
+	if (lseek(fd, offset, SEEK_SET) == -1)
+		return -1;
+
+	return read(fd, buf, count);
+#else
+	return pread(fd, buf, count, offset);
+#endif
+}
+
+
+/* pwrite counterpart of memo_pread. */
+static ssize_t memo_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+#ifdef _WIN32
+	if (lseek(fd, offset, SEEK_SET) == -1)
+		return -1;
+
+	return write(fd, buf, count);
+#else
+	return pwrite(fd, buf, count, offset);
+#endif
+}
+
+
+/* Flush file to disk. Returns 0 on success, -1 on failure. */
+static int memo_fsync(int fd)
+{
+#ifdef _WIN32
+	return _commit(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+
+/* Flush the directory containing path to disk, so a newly created
+ * file is not lost in a crash. Errors are ignored.
+ */
+static void fsync_parent_dir(const char *path)
+{
+#ifndef _WIN32
+	char *dir = strdup(path);
+	char *slash;
+	int fd;
+
+	if (dir == NULL)
+		return;
+
+	slash = strrchr(dir, '/');
+
+	if (slash == dir)
+		slash[1] = '\0';
+	else if (slash)
+		*slash = '\0';
+	else
+		strcpy(dir, ".");
+
+	fd = open(dir, O_RDONLY);
+
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+
+	free(dir);
+#endif
+}
+
+
+/* Parse the id at the start of a note line of len bytes. line does
+ * not need to be NUL terminated.
+ *
+ * Returns the id, or -1 if the line does not start with one.
+ */
+static int get_note_id_from_view(const char *line, size_t len)
+{
+	int id = 0;
+	size_t i;
+
+	for (i = 0; i < len && isdigit((unsigned char)line[i]); i++)
+		id = id * 10 + (line[i] - '0');
+
+	if (i == 0)
+		return -1;
+
+	return id;
+}
+
+
+/* Modification time of the file described by st in nanoseconds, so
+ * the sidecar files notice changes within the same second. Platforms
+ * without nanoseconds get whole seconds.
+ */
+static int64_t memo_mtime_ns(const struct stat *st)
+{
+	int64_t nsec = 0;
+
+#if defined(st_mtime)
+	/* POSIX.1-2008 st_mtim, st_mtime is a macro for its seconds */
+	nsec = st->st_mtim.tv_nsec;
+#elif defined(__GLIBC__) || defined(__APPLE__)
+	nsec = st->st_mtimensec;
+#endif
+
+	return (int64_t)st->st_mtime * 1000000000 + nsec;
+}
+
+
+/* Set the memo file size and modification time the index is
+ * valid for.
+ */
+static void memo_index_stamp(struct memo_index_header *header,
+			     const struct stat *st)
+{
+	header->memo_size = st->st_size;
+	header->memo_mtime = memo_mtime_ns(st);
+}
+
+
+/* Point the record and slot tables of idx to the index image in
+ * idx->data. Returns 0 if the image is a valid index for the memo
+ * file described by st, -1 otherwise.
+ */
+static int memo_index_attach(struct memo_index *idx, const struct stat *st)
+{
+	const struct memo_index_header *header;
+	size_t need;
+
+	if (idx->size < sizeof(*header))
+		return -1;
+
+	header = (const struct memo_index_header *)idx->data;
+
+	if (memcmp(header->magic, MEMO_INDEX_MAGIC, 4) != 0 ||
+	    header->version != MEMO_INDEX_VERSION)
+		return -1;
+
+	if (header->memo_size != (uint64_t)st->st_size ||
+	    header->memo_mtime != memo_mtime_ns(st))
+		return -1;
+
+	need = sizeof(*header) +
+		header->slot_count * sizeof(uint32_t) +
+		header->count * sizeof(struct memo_index_record);
+
+	if (idx->size != need || header->slot_count % 2 != 0)
+		return -1;
+
+	idx->header = header;
+	idx->slots = (const uint32_t *)(header + 1);
+	idx->records = (const struct memo_index_record *)
+		(idx->slots + header->slot_count);
+
+	return 0;
+}
+
+
+/* Build the index image for the memo file in memory and try to
+ * save it next to the memo file. Failing to save the index is not an
+ * error, the image built in memory is used in that case.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int memo_index_build(struct memo_index *idx, const struct stat *st)
+{
+	struct memo_map map;
+	struct line_view line;
+	struct memo_index_header *header;
+	struct memo_index_record *records;
+	uint32_t *slots;
+	size_t pos = 0;
+	size_t count = 0;
+	size_t alloc = 1024;
+	int max_id = 0;
+
+	if (memo_map_open(&map) == -1)
+		return -1;
+
+	records = malloc(alloc * sizeof(*records));
+
+	if (records == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		memo_map_close(&map);
+		return -1;
+	}
+
+	while (memo_map_next_line(&map, &pos, &line)) {
+		if (count == alloc) {
+			struct memo_index_record *tmp;
+
+			alloc *= 2;
+			tmp = realloc(records, alloc * sizeof(*records));
+
+			if (tmp == NULL) {
+				fail(stderr, "%s: realloc failed\n", __func__);
+				free(records);
+				memo_map_close(&map);
+				return -1;
+			}
+
+			records = tmp;
+		}
+
+		memset(&records[count], 0, sizeof(*records));
+		records[count].offset = line.str - map.data;
+		records[count].length = line.len;
+		records[count].id = get_note_id_from_view(line.str, line.len);
+		records[count].status = get_note_status_char(line.str,
+							     line.len);
+
+		if (records[count].id > max_id)
+			max_id = records[count].id;
+
+		count++;
+	}
+
+	memo_map_close(&map);
+
+	/* Slots map an id straight to its record. Skip them if ids are
+	 * too sparse for that to make sense, lookups will scan the
+	 * records instead.
+	 */
+	size_t slot_count = 0;
+
+	if ((size_t)max_id <= count * 8 + 1024)
+		slot_count = ((size_t)max_id + 1 + MEMO_INDEX_SPARE_SLOTS) & ~1;
+
+	idx->size = sizeof(*header) + slot_count * sizeof(*slots) +
+		count * sizeof(*records);
+	idx->data = calloc(1, idx->size);
+	idx->is_mapped = 0;
+
+	if (idx->data == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		free(records);
+		return -1;
+	}
+
+	header = (struct memo_index_header *)idx->data;
+	memcpy(header->magic, MEMO_INDEX_MAGIC, 4);
+	header->version = MEMO_INDEX_VERSION;
+	header->count = count;
+	header->slot_count = slot_count;
+	memo_index_stamp(header, st);
+
+	slots = (uint32_t *)(header + 1);
+	memcpy(slots + slot_count, records, count * sizeof(*records));
+
+	/* Slot holds the record number plus one, zero means there's
+	 * no note with the id. The first note wins if ids are not
+	 * unique.
+	 */
+	for (size_t i = 0; i < count; i++) {
+		int id = records[i].id;
+
+		if (id >= 0 && (size_t)id < slot_count && slots[id] == 0)
+			slots[id] = i + 1;
+	}
+
+	free(records);
+
+	memo_index_attach(idx, st);
+	memo_index_save(idx);
+
+	return 0;
+}
+
+
+/* Write the index image to the .memo.idx file. The image is
+ * written to a temporary file first and then renamed, so readers never
+ * see a partially written index.
+ */
+static void memo_index_save(const struct memo_index *idx)
+{
+	char *path = get_memo_sidecar_path(".idx");
+	char *tmp = get_memo_sidecar_path(".idx.tmp");
+	FILE *fp = NULL;
+
+	if (path == NULL || tmp == NULL)
+		goto out;
+
+	fp = fopen(tmp, "wb");
+
+	if (fp == NULL)
+		goto out;
+
+	if (fwrite(idx->data, 1, idx->size, fp) != idx->size) {
+		fclose(fp);
+		remove(tmp);
+		goto out;
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) != 0)
+		remove(tmp);
+
+out:
+	free(path);
+	free(tmp);
+}
+
+
+/* Open the note index of the memo file. If the .memo.idx file is
+ * missing or does not match the size and modification time of the
+ * memo file, the index is rebuilt.
+ *
+ * Returns 0 on success, -1 on failure. Caller must call
+ * memo_index_close after calling the function successfully.
+ */
+static int memo_index_open(struct memo_index *idx)
+{
+	char *memofile = NULL;
+	struct stat st;
+
+	memset(idx, 0, sizeof(*idx));
+
+	memofile = get_memo_file_path();
+
+	if (memofile == NULL)
+		return -1;
+
+	if (stat(memofile, &st) == -1) {
+		fail(stderr, "%s: error reading %s\n", __func__, memofile);
+		free(memofile);
+		return -1;
+	}
+
+	free(memofile);
+
+	if (memo_index_load(idx, &st) == 0)
+		return 0;
+
+	return memo_index_build(idx, &st);
+}
+
+
+/* Open the existing .memo.idx file if it's valid for the memo file
+ * st is for. The index is not built, see memo_index_open.
+ *
+ * Returns 0 on success, -1 if there's no valid index. Caller must call
+ * memo_index_close after calling the function successfully.
+ */
+static int memo_index_load(struct memo_index *idx, const struct stat *st)
+{
+	char *path = NULL;
+	struct stat idx_st;
+	int fd;
+
+	memset(idx, 0, sizeof(*idx));
+
+	path = get_memo_sidecar_path(".idx");
+
+	if (path == NULL)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &idx_st) == 0 && idx_st.st_size > 0) {
+		idx->size = idx_st.st_size;
+#ifdef _WIN32
+		idx->data = malloc(idx->size);
+
+		if (idx->data &&
+		    read(fd, idx->data, idx->size) != (ssize_t)idx->size) {
+			free(idx->data);
+			idx->data = NULL;
+		}
+#else
+		idx->data = mmap(NULL, idx->size, PROT_READ, MAP_SHARED,
+				 fd, 0);
+
+		if (idx->data == MAP_FAILED)
+			idx->data = NULL;
+		else
+			idx->is_mapped = 1;
+#endif
+	}
+
+	close(fd);
+
+	if (idx->data && memo_index_attach(idx, st) == 0)
+		return 0;
+
+	memo_index_close(idx);
+
+	return -1;
+}
+
+
+/* Release the index opened with memo_index_open. */
+static void memo_index_close(struct memo_index *idx)
+{
+#ifndef _WIN32
+	if (idx->is_mapped)
+		munmap(idx->data, idx->size);
+	else
+#endif
+		free(idx->data);
+
+	memset(idx, 0, sizeof(*idx));
+}
+
+
+/* Remove the .memo.idx file. Called after the memo file is rewritten,
+ * the index is then rebuilt on the next lookup.
+ */
+static void memo_index_invalidate()
+{
+	char *path = get_memo_sidecar_path(".idx");
+
+	if (path == NULL)
+		return;
+
+	if (file_exists(path))
+		remove(path);
+
+	free(path);
+}
+
+
+/* Update the .memo.idx file after the note at offset, len bytes long,
+ * was replaced by line, or removed when line is NULL. Records after
+ * the note are moved instead of parsing the memo file again.
+ *
+ * old is the memo file before the change, the index is dropped if
+ * it's not valid for it. new is the memo file after the change.
+ */
+static void memo_index_update(const struct stat *old, const struct stat *new,
+			      off_t offset, size_t len, const char *line)
+{
+	struct memo_index idx;
+	struct memo_index_header *header;
+	struct memo_index_record *records;
+	uint32_t *slots;
+	uint32_t found = 0;
+	int64_t delta;
+
+	memset(&idx, 0, sizeof(idx));
+
+	char *path = get_memo_sidecar_path(".idx");
+
+	if (path == NULL)
+		return;
+
+	FILE *fp = fopen(path, "rb");
+
+	free(path);
+
+	if (fp == NULL)
+		return;
+
+	if (fseek(fp, 0, SEEK_END) == 0 && (idx.size = ftell(fp)) > 0)
+		idx.data = malloc(idx.size);
+
+	rewind(fp);
+
+	if (idx.data == NULL || fread(idx.data, 1, idx.size, fp) != idx.size ||
+	    memo_index_attach(&idx, old) == -1) {
+		fclose(fp);
+		memo_index_close(&idx);
+		memo_index_invalidate();
+		return;
+	}
+
+	fclose(fp);
+
+	header = (struct memo_index_header *)idx.data;
+	slots = (uint32_t *)(header + 1);
+	records = (struct memo_index_record *)(slots + header->slot_count);
+
+	while (found < header->count && records[found].offset != (uint64_t)offset)
+		found++;
+
+	if (found == header->count || records[found].length != len) {
+		memo_index_close(&idx);
+		memo_index_invalidate();
+		return;
+	}
+
+	if (line != NULL) {
+		delta = (int64_t)strlen(line) - (int64_t)len;
+		records[found].length = strlen(line);
+		records[found].status = get_note_status_char(line,
+							     strlen(line));
+	} else {
+		/* Removed note takes its new line character with it */
+		delta = -(int64_t)len - 1;
+
+		for (uint32_t i = 0; i < header->slot_count; i++) {
+			if (slots[i] == found + 1)
+				slots[i] = 0;
+			else if (slots[i] > found + 1)
+				slots[i]--;
+		}
+
+		memmove(&records[found], &records[found + 1],
+			(header->count - found - 1) * sizeof(*records));
+		header->count--;
+		idx.size -= sizeof(*records);
+	}
+
+	for (uint32_t i = found; i < header->count; i++) {
+		if (records[i].offset > (uint64_t)offset)
+			records[i].offset += delta;
+	}
+
+	memo_index_stamp(header, new);
+	memo_index_save(&idx);
+	memo_index_close(&idx);
+}
+
+
+/* Move the .memo.idx file to the new size and modification time of
+ * the memo file, when the statuses of the notes have changed in place.
+ * The status of the record of each change is found with a binary
+ * search over the records, which are in the order of the memo file.
+ * Nothing is done if the index is not valid for old.
+ */
+static void memo_index_restamp(const struct stat *old, const struct stat *new,
+			       const struct status_change *changes,
+			       size_t count)
+{
+	struct memo_index_header header;
+	struct memo_index_record rec;
+	char *path = NULL;
+	off_t records;
+	int fd;
+
+	/* Rebuilding is cheaper than finding many records one by one */
+	if (count > MEMO_INDEX_MAX_PATCH) {
+		memo_index_invalidate();
+		return;
+	}
+
+	path = get_memo_sidecar_path(".idx");
+
+	if (path == NULL)
+		return;
+
+	fd = open(path, O_RDWR);
+	free(path);
+
+	if (fd == -1)
+		return;
+
+	if (memo_pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, MEMO_INDEX_MAGIC, 4) != 0 ||
+	    header.version != MEMO_INDEX_VERSION ||
+	    header.memo_size != (uint64_t)old->st_size ||
+	    header.memo_mtime != memo_mtime_ns(old)) {
+		close(fd);
+		return;
+	}
+
+	records = sizeof(header) + (off_t)header.slot_count * sizeof(uint32_t);
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t lo = 0;
+		uint32_t hi = header.count;
+		off_t at;
+
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+
+			at = records + (off_t)mid * sizeof(rec);
+
+			if (memo_pread(fd, &rec, sizeof(rec), at) != sizeof(rec))
+				goto invalidate;
+
+			if (rec.offset + rec.length <= changes[i].offset)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		at = records + (off_t)lo * sizeof(rec);
+
+		if (lo == header.count ||
+		    memo_pread(fd, &rec, sizeof(rec), at) != sizeof(rec) ||
+		    rec.offset > changes[i].offset)
+			goto invalidate;
+
+		rec.status = changes[i].new;
+
+		if (memo_pwrite(fd, &rec, sizeof(rec), at) != sizeof(rec))
+			goto invalidate;
+	}
+
+	memo_index_stamp(&header, new);
+	memo_pwrite(fd, &header, sizeof(header), 0);
+	close(fd);
+
+	return;
+
+invalidate:
+	close(fd);
+	memo_index_invalidate();
+}
+
+
+/* Add the records of len bytes of notes appended to the memo file to
+ * the .memo.idx file and move it to the new size and modification time
+ * of the memo file. The records are appended to the end of the index
+ * and the header is written last, so an interrupted update leaves an
+ * index of the wrong size, which is rebuilt. Nothing is done if the
+ * index is not valid for old.
+ */
+static void memo_index_append(const struct stat *old, const struct stat *new,
+			      const char *notes, size_t len)
+{
+	struct memo_index_header header;
+	struct memo_index_record rec;
+	struct stat st;
+	char *path = NULL;
+	off_t records;
+	off_t end;
+	size_t pos = 0;
+	int fd;
+
+	path = get_memo_sidecar_path(".idx");
+
+	if (path == NULL)
+		return;
+
+	fd = open(path, O_RDWR);
+	free(path);
+
+	if (fd == -1)
+		return;
+
+	if (memo_pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, MEMO_INDEX_MAGIC, 4) != 0 ||
+	    header.version != MEMO_INDEX_VERSION ||
+	    header.memo_size != (uint64_t)old->st_size ||
+	    header.memo_mtime != memo_mtime_ns(old)) {
+		close(fd);
+		return;
+	}
+
+	records = sizeof(header) + (off_t)header.slot_count * sizeof(uint32_t);
+	end = records + (off_t)header.count * sizeof(rec);
+
+	if (fstat(fd, &st) == -1 || st.st_size != end)
+		goto invalidate;
+
+	/* New records continue the offsets of the old ones only if the
+	 * last note ended the old memo file.
+	 */
+	if (header.count == 0) {
+		if (old->st_size != 0)
+			goto invalidate;
+	} else if (memo_pread(fd, &rec, sizeof(rec), end - sizeof(rec)) !=
+		   sizeof(rec) ||
+		   rec.offset + rec.length + 1 != (uint64_t)old->st_size) {
+		goto invalidate;
+	}
+
+	while (pos < len) {
+		const char *start = notes + pos;
+		const char *nl = scan_byte(start, len - pos, '\n');
+		size_t line_len = nl ? (size_t)(nl - start) : len - pos;
+
+		pos += nl ? line_len + 1 : line_len;
+
+		if (line_len == 0)
+			continue;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.offset = old->st_size + (start - notes);
+		rec.length = line_len;
+		rec.id = get_note_id_from_view(start, line_len);
+		rec.status = get_note_status_char(start, line_len);
+
+		/* Record goes first, the file grows and no longer matches
+		 * the header if writing the slot fails.
+		 */
+		if (memo_pwrite(fd, &rec, sizeof(rec), end) != sizeof(rec))
+			goto invalidate;
+
+		if (header.slot_count > 0 && rec.id >= 0) {
+			off_t at = sizeof(header) + (off_t)rec.id * sizeof(uint32_t);
+			uint32_t slot;
+
+			/* Out of free slots, let the next build size them */
+			if ((size_t)rec.id >= header.slot_count)
+				goto invalidate;
+
+			if (memo_pread(fd, &slot, sizeof(slot), at) != sizeof(slot))
+				goto invalidate;
+
+			if (slot == 0) {
+				slot = header.count + 1;
+
+				if (memo_pwrite(fd, &slot, sizeof(slot), at) !=
+				    sizeof(slot))
+					goto invalidate;
+			}
+		}
+
+		end += sizeof(rec);
+		header.count++;
+	}
+
+	memo_index_stamp(&header, new);
+
+	if (memo_pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+		goto invalidate;
+
+	close(fd);
+
+	return;
+
+invalidate:
+	close(fd);
+	memo_index_invalidate();
+}
+
+
+/* Find the record of the note with given id.
+ *
+ * Returns the record or NULL when there's no such note.
+ */
+static const struct memo_index_record *memo_index_find(
+	const struct memo_index *idx, int id)
+{
+	if (id < 0)
+		return NULL;
+
+	if (idx->header->slot_count > 0) {
+		uint32_t slot;
+
+		if ((size_t)id >= idx->header->slot_count)
+			return NULL;
+
+		slot = idx->slots[id];
+
+		return slot ? &idx->records[slot - 1] : NULL;
+	}
+
+	for (uint32_t i = 0; i < idx->header->count; i++) {
+		if (idx->records[i].id == id)
+			return &idx->records[i];
+	}
+
+	return NULL;
+}
+
+
+/* Read the note with given id straight from its offset in the memo
+ * file using the note index. The line read is checked against the
+ * index, if they disagree the index is rebuilt once.
+ *
+ * On success the offset and length (without the new line character)
+ * of the note are stored to offset and len.
+ *
+ * Returns the note line or NULL if the note is not found or reading
+ * fails. Caller is responsible for freeing the return value.
+ */
+static char *get_note_by_id(int id, off_t *offset, size_t *len)
+{
+	struct memo_index idx;
+	const struct memo_index_record *rec;
+	char *memofile = NULL;
+	char *line = NULL;
+	int fd = -1;
+
+	memofile = get_memo_file_path();
+
+	if (memofile == NULL)
+		return NULL;
+
+	for (int tries = 0; tries < 2; tries++) {
+		if (tries > 0)
+			memo_index_invalidate();
+
+		if (memo_index_open(&idx) == -1)
+			break;
+
+		rec = memo_index_find(&idx, id);
+
+		if (rec == NULL) {
+			memo_index_close(&idx);
+			break;
+		}
+
+		*offset = rec->offset;
+		*len = rec->length;
+		memo_index_close(&idx);
+
+		fd = open(memofile, O_RDONLY);
+
+		if (fd == -1) {
+			fail(stderr, "%s: error opening %s\n", __func__,
+				memofile);
+			break;
+		}
+
+		/* Read the terminating new line as well to verify
+		 * the note ends where the index says it ends.
+		 */
+		line = malloc(*len + 2);
+
+		if (line == NULL) {
+			fail(stderr, "%s: malloc failed\n", __func__);
+			break;
+		}
+
+		ssize_t ret = memo_pread(fd, line, *len + 1, *offset);
+
+		close(fd);
+		fd = -1;
+
+		if (ret >= (ssize_t)*len &&
+		    (ret == (ssize_t)*len || line[*len] == '\n') &&
+		    memchr(line, '\n', *len) == NULL &&
+		    get_note_id_from_view(line, *len) == id) {
+			line[*len] = '\0';
+			free(memofile);
+			return line;
+		}
+
+		free(line);
+		line = NULL;
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	free(memofile);
+
+	return NULL;
+}
+
+
+/* Append offset to the postings of key in the builder. Adding the same
+ * offset to a key again is ignored, offsets must be added in
+ * ascending order.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int posting_builder_add(struct posting_builder *b,
+			       const unsigned char *key, size_t len,
+			       uint64_t offset)
+{
+	struct posting_entry *e;
+	uint32_t hash = 2166136261u;
+	size_t mask;
+	size_t i;
+
+	for (size_t k = 0; k < len; k++)
+		hash = (hash ^ key[k]) * 16777619u;
+
+	/* Keep the table at most half full */
+	if ((b->entry_count + 1) * 2 > b->entry_alloc) {
+		size_t alloc = b->entry_alloc ? b->entry_alloc * 2 : 4096;
+		struct posting_entry *entries = calloc(alloc, sizeof(*entries));
+
+		if (entries == NULL) {
+			fail(stderr, "%s: malloc failed\n", __func__);
+			return -1;
+		}
+
+		for (size_t j = 0; j < b->entry_alloc; j++) {
+			if (b->entries[j].buf == NULL)
+				continue;
+
+			i = b->entries[j].hash & (alloc - 1);
+
+			while (entries[i].buf != NULL)
+				i = (i + 1) & (alloc - 1);
+
+			entries[i] = b->entries[j];
+		}
+
+		free(b->entries);
+		b->entries = entries;
+		b->entry_alloc = alloc;
+	}
+
+	mask = b->entry_alloc - 1;
+	i = hash & mask;
+
+	for (;;) {
+		e = &b->entries[i];
+
+		if (e->buf == NULL)
+			break;
+
+		if (e->hash == hash && e->key_len == len &&
+		    memcmp(b->key_bytes + e->key_offset, key, len) == 0)
+			break;
+
+		i = (i + 1) & mask;
+	}
+
+	if (e->buf == NULL) {
+		if (b->key_bytes_len + len > b->key_bytes_alloc) {
+			size_t alloc = b->key_bytes_alloc ?
+				b->key_bytes_alloc : 65536;
+			char *tmp;
+
+			while (b->key_bytes_len + len > alloc)
+				alloc *= 2;
+
+			tmp = realloc(b->key_bytes, alloc);
+
+			if (tmp == NULL) {
+				fail(stderr, "%s: realloc failed\n", __func__);
+				return -1;
+			}
+
+			b->key_bytes = tmp;
+			b->key_bytes_alloc = alloc;
+		}
+
+		e->buf = malloc(8);
+
+		if (e->buf == NULL) {
+			fail(stderr, "%s: malloc failed\n", __func__);
+			return -1;
+		}
+
+		memcpy(b->key_bytes + b->key_bytes_len, key, len);
+		e->key_offset = b->key_bytes_len;
+		e->key_len = len;
+		e->hash = hash;
+		e->buf_alloc = 8;
+		b->key_bytes_len += len;
+		b->entry_count++;
+	} else if (e->last == offset) {
+		return 0;
+	}
+
+	/* At most ten bytes for a 64-bit varint */
+	if (e->buf_len + 10 > e->buf_alloc) {
+		unsigned char *tmp = realloc(e->buf, e->buf_alloc * 2);
+
+		if (tmp == NULL) {
+			fail(stderr, "%s: realloc failed\n", __func__);
+			return -1;
+		}
+
+		e->buf = tmp;
+		e->buf_alloc *= 2;
+	}
+
+	uint64_t delta = offset - (e->count ? e->last : 0);
+
+	while (delta >= 0x80) {
+		e->buf[e->buf_len++] = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+
+	e->buf[e->buf_len++] = delta;
+	e->last = offset;
+	e->count++;
+
+	return 0;
+}
+
+
+static void posting_builder_free(struct posting_builder *b)
+{
+	for (size_t i = 0; i < b->entry_alloc; i++)
+		free(b->entries[i].buf);
+
+	free(b->entries);
+	free(b->key_bytes);
+	memset(b, 0, sizeof(*b));
+}
+
+
+/* Key bytes of the builder being sorted, see posting_entry_sort */
+static const char *posting_sort_keys;
+
+/* Comparator for qsort, sorts builder entries by key */
+static int posting_entry_sort(const void *a, const void *b)
+{
+	const struct posting_entry *x = *(const struct posting_entry **)a;
+	const struct posting_entry *y = *(const struct posting_entry **)b;
+	size_t len = x->key_len < y->key_len ? x->key_len : y->key_len;
+	int ret = memcmp(posting_sort_keys + x->key_offset,
+			 posting_sort_keys + y->key_offset, len);
+
+	if (ret != 0)
+		return ret;
+
+	return (x->key_len > y->key_len) - (x->key_len < y->key_len);
+}
+
+
+/* Write the keys and postings of the builder to the posting index
+ * file of the memo file with given suffix. The index is valid for the
+ * memo file described by st, of which indexed_size bytes were indexed.
+ * The file is written to a temporary file first and then renamed.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int posting_index_save(struct posting_builder *b, const char *suffix,
+			      const char *magic, const struct stat *st,
+			      uint64_t indexed_size)
+{
+	struct posting_index_header header;
+	struct posting_entry **sorted = NULL;
+	char *path = get_memo_sidecar_path(suffix);
+	char *tmp = NULL;
+	FILE *fp = NULL;
+	uint64_t postings_size = 0;
+	size_t n = 0;
+	int ret = -1;
+
+	if (path == NULL)
+		return -1;
+
+	tmp = malloc(strlen(path) + 5);
+	sorted = malloc((b->entry_count + 1) * sizeof(*sorted));
+
+	if (tmp == NULL || sorted == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		goto out;
+	}
+
+	sprintf(tmp, "%s.tmp", path);
+
+	for (size_t i = 0; i < b->entry_alloc; i++) {
+		if (b->entries[i].buf != NULL) {
+			sorted[n++] = &b->entries[i];
+			postings_size += b->entries[i].buf_len;
+		}
+	}
+
+	posting_sort_keys = b->key_bytes;
+	qsort(sorted, n, sizeof(*sorted), posting_entry_sort);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, magic, 4);
+	header.version = POSTING_INDEX_VERSION;
+	header.memo_size = st->st_size;
+	header.memo_mtime = memo_mtime_ns(st);
+	header.indexed_size = indexed_size;
+	header.key_bytes_size = b->key_bytes_len;
+	header.postings_size = postings_size;
+	header.key_count = n;
+
+	fp = fopen(tmp, "wb");
+
+	if (fp == NULL)
+		goto out;
+
+	fwrite(&header, sizeof(header), 1, fp);
+
+	uint64_t postings_offset = 0;
+	uint32_t key_offset = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		struct posting_key key;
+
+		key.postings_offset = postings_offset;
+		key.postings_len = sorted[i]->buf_len;
+		key.count = sorted[i]->count;
+		key.key_offset = key_offset;
+		key.key_len = sorted[i]->key_len;
+		fwrite(&key, sizeof(key), 1, fp);
+
+		postings_offset += sorted[i]->buf_len;
+		key_offset += sorted[i]->key_len;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		fwrite(b->key_bytes + sorted[i]->key_offset, 1,
+		       sorted[i]->key_len, fp);
+
+	for (size_t i = 0; i < n; i++)
+		fwrite(sorted[i]->buf, 1, sorted[i]->buf_len, fp);
+
+	if (ferror(fp) || fclose(fp) != 0 || rename(tmp, path) != 0) {
+		remove(tmp);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	free(sorted);
+	free(path);
+	free(tmp);
+
+	return ret;
+}
+
+
+/* Open the posting index file of the memo file with given suffix. The
+ * index must be valid for the memo file described by st.
+ *
+ * Returns 0 on success, -1 if the index is missing or not valid.
+ * Caller must call posting_index_close after calling the function
+ * successfully.
+ */
+static int posting_index_open(struct posting_index *pi, const char *suffix,
+			      const char *magic, const struct stat *st)
+{
+	const struct posting_index_header *header;
+	struct stat pi_st;
+	char *path = get_memo_sidecar_path(suffix);
+	int fd;
+
+	memset(pi, 0, sizeof(*pi));
+
+	if (path == NULL)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &pi_st) == 0 && pi_st.st_size > 0) {
+		pi->size = pi_st.st_size;
+#ifdef _WIN32
+		pi->data = malloc(pi->size);
+
+		if (pi->data &&
+		    read(fd, pi->data, pi->size) != (ssize_t)pi->size) {
+			free(pi->data);
+			pi->data = NULL;
+		}
+#else
+		pi->data = mmap(NULL, pi->size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (pi->data == MAP_FAILED)
+			pi->data = NULL;
+		else
+			pi->is_mapped = 1;
+#endif
+	}
+
+	close(fd);
+
+	if (pi->data == NULL || pi->size < sizeof(*header))
+		goto invalid;
+
+	header = (const struct posting_index_header *)pi->data;
+
+	if (memcmp(header->magic, magic, 4) != 0 ||
+	    header->version != POSTING_INDEX_VERSION ||
+	    header->memo_size != (uint64_t)st->st_size ||
+	    header->memo_mtime != memo_mtime_ns(st) ||
+	    header->indexed_size > header->memo_size)
+		goto invalid;
+
+	if (pi->size != sizeof(*header) +
+	    header->key_count * sizeof(struct posting_key) +
+	    header->key_bytes_size + header->postings_size)
+		goto invalid;
+
+	pi->header = header;
+	pi->keys = (const struct posting_key *)(header + 1);
+	pi->key_bytes = (const char *)(pi->keys + header->key_count);
+	pi->postings = (const unsigned char *)pi->key_bytes +
+		header->key_bytes_size;
+
+	return 0;
+
+invalid:
+	posting_index_close(pi);
+
+	return -1;
+}
+
+
+/* Release the index opened with posting_index_open. */
+static void posting_index_close(struct posting_index *pi)
+{
+#ifndef _WIN32
+	if (pi->is_mapped)
+		munmap(pi->data, pi->size);
+	else
+#endif
+		free(pi->data);
+
+	memset(pi, 0, sizeof(*pi));
+}
+
+
+/* Decode the postings of key to offsets, which must have room for
+ * key->count offsets.
+ *
+ * Returns the count of decoded offsets.
+ */
+static size_t posting_decode(const struct posting_index *pi,
+			     const struct posting_key *key, uint64_t *offsets)
+{
+	const unsigned char *p = pi->postings + key->postings_offset;
+	const unsigned char *end = p + key->postings_len;
+	uint64_t offset = 0;
+	size_t n = 0;
+
+	if (key->postings_offset + key->postings_len >
+	    pi->header->postings_size)
+		return 0;
+
+	while (p < end && n < key->count) {
+		uint64_t delta = 0;
+		int shift = 0;
+
+		while (p < end && (*p & 0x80) && shift < 63) {
+			delta |= (uint64_t)(*p++ & 0x7f) << shift;
+			shift += 7;
+		}
+
+		if (p == end)
+			break;
+
+		delta |= (uint64_t)*p++ << shift;
+		offset += delta;
+		offsets[n++] = offset;
+	}
+
+	return n;
+}
+
+
+/* Move the posting index with given suffix to the new size and
+ * modification time of the memo file after notes were appended to
+ * it. The appended notes are left out of the index, searches scan
+ * them. Nothing is done if the index is not valid for old.
+ */
+static void posting_index_restamp(const char *suffix, const char *magic,
+				  const struct stat *old,
+				  const struct stat *new)
+{
+	struct posting_index_header header;
+	char *path = get_memo_sidecar_path(suffix);
+	int fd;
+
+	if (path == NULL)
+		return;
+
+	fd = open(path, O_RDWR);
+	free(path);
+
+	if (fd == -1)
+		return;
+
+	if (memo_pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+	    memcmp(header.magic, magic, 4) == 0 &&
+	    header.version == POSTING_INDEX_VERSION &&
+	    header.memo_size == (uint64_t)old->st_size &&
+	    header.memo_mtime == memo_mtime_ns(old)) {
+		header.memo_size = new->st_size;
+		header.memo_mtime = memo_mtime_ns(new);
+		memo_pwrite(fd, &header, sizeof(header), 0);
+	}
+
+	close(fd);
+}
+
+
+/* Remove the search indexes of the memo file. Called whenever notes
+ * change in some other way than being appended.
+ */
+static void search_index_invalidate()
+{
+	static const char *suffixes[] = { ".words", ".tri" };
+
+	for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		char *path = get_memo_sidecar_path(suffixes[i]);
+
+		if (path == NULL)
+			return;
+
+		if (file_exists(path))
+			remove(path);
+
+		free(path);
+	}
+}
+
+
+/* Returns 1 if the search indexes are enabled in ~/.memorc */
+static int search_index_enabled()
+{
+	const char *value = get_memo_conf_value(CONF_SEARCH_INDEX);
+
+	return value != NULL && strcmp(value, "yes") == 0;
+}
+
+
+/* Bytes of which the words in .memo.words consist of. Bytes of UTF-8
+ * sequences are part of words too.
+ */
+static int is_word_byte(unsigned char c)
+{
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+		(c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+
+/* Build the .memo.words index of the mapped memo file. Every word of
+ * every note, including the id, status and date fields, is indexed in
+ * lower case.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int word_index_build(const struct memo_map *map)
+{
+	struct posting_builder b;
+	struct line_view line;
+	unsigned char *word = NULL;
+	size_t word_size = 0;
+	size_t pos = 0;
+	int ret = -1;
+
+	memset(&b, 0, sizeof(b));
+
+	while (memo_map_next_line(map, &pos, &line)) {
+		const unsigned char *p = (const unsigned char *)line.str;
+		uint64_t offset = line.str - map->data;
+		size_t i = 0;
+
+		if (line.len > word_size) {
+			free(word);
+			word_size = line.len;
+			word = malloc(word_size);
+
+			if (word == NULL) {
+				fail(stderr, "%s: malloc failed\n", __func__);
+				goto out;
+			}
+		}
+
+		while (i < line.len) {
+			size_t len = 0;
+
+			while (i < line.len && !is_word_byte(p[i]))
+				i++;
+
+			while (i < line.len && is_word_byte(p[i]))
+				word[len++] = fold_byte(p[i++]);
+
+			if (len > 0 &&
+			    posting_builder_add(&b, word, len, offset) == -1)
+				goto out;
+		}
+	}
+
+	ret = posting_index_save(&b, ".words", WORD_INDEX_MAGIC, &map->st,
+				 map->size);
+out:
+	free(word);
+	posting_builder_free(&b);
+
+	return ret;
+}
+
+
+/* Sort offsets and remove the duplicates. Returns the new count. */
+static size_t offsets_sort_unique(uint64_t *offsets, size_t count)
+{
+	size_t n = 0;
+
+	/* offsets may be NULL when nothing was found */
+	if (count == 0)
+		return 0;
+
+	qsort(offsets, count, sizeof(*offsets), offset_sort);
+
+	for (size_t i = 0; i < count; i++) {
+		if (n == 0 || offsets[n - 1] != offsets[i])
+			offsets[n++] = offsets[i];
+	}
+
+	return n;
+}
+
+
+/* Comparator for qsort, sorts note offsets in ascending order */
+static int offset_sort(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* Merge sorted set b to sorted set a, keeping only the offsets in
+ * both sets when intersect is set and offsets in either otherwise.
+ * b is released.
+ *
+ * Returns 0 on success. On failure both sets are released and -1 is
+ * returned.
+ */
+static int offset_set_merge(struct offset_set *a, struct offset_set *b,
+			    int intersect)
+{
+	uint64_t *out = malloc((a->count + b->count + 1) * sizeof(*out));
+	size_t i = 0, j = 0, n = 0;
+
+	if (out == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		free(a->offsets);
+		free(b->offsets);
+		memset(a, 0, sizeof(*a));
+		memset(b, 0, sizeof(*b));
+		return -1;
+	}
+
+	while (i < a->count && j < b->count) {
+		if (a->offsets[i] < b->offsets[j]) {
+			if (!intersect)
+				out[n++] = a->offsets[i];
+			i++;
+		} else if (a->offsets[i] > b->offsets[j]) {
+			if (!intersect)
+				out[n++] = b->offsets[j];
+			j++;
+		} else {
+			out[n++] = a->offsets[i];
+			i++;
+			j++;
+		}
+	}
+
+	if (!intersect) {
+		while (i < a->count)
+			out[n++] = a->offsets[i++];
+
+		while (j < b->count)
+			out[n++] = b->offsets[j++];
+	}
+
+	free(a->offsets);
+	free(b->offsets);
+	a->offsets = out;
+	a->count = n;
+	b->offsets = NULL;
+	b->count = 0;
+
+	return 0;
+}
+
+
+/* Find the notes which have a word containing the len bytes of piece,
+ * which must consist of word bytes. The key bytes of the index are
+ * searched as one string and each match is mapped back to its key.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int word_index_lookup(const struct posting_index *pi,
+			     const unsigned char *piece, size_t len,
+			     struct offset_set *set)
+{
+	const struct posting_key *keys = pi->keys;
+	const char *bytes = pi->key_bytes;
+	size_t bytes_len = pi->header->key_bytes_size;
+	struct search_term term;
+	unsigned char *folded = malloc(len);
+	size_t alloc = 0;
+	size_t pos = 0;
+
+	set->offsets = NULL;
+	set->count = 0;
+
+	if (folded == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	search_term_compile(&term, (const char *)piece, len, folded);
+
+	while (pos < bytes_len) {
+		const char *match = search_term_find(&term, bytes + pos,
+						     bytes_len - pos);
+		size_t lo = 0;
+		size_t hi = pi->header->key_count;
+
+		if (match == NULL)
+			break;
+
+		/* The last key starting at or before the match */
+		while (hi - lo > 1) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (keys[mid].key_offset <= (size_t)(match - bytes))
+				lo = mid;
+			else
+				hi = mid;
+		}
+
+		const struct posting_key *key = &keys[lo];
+		size_t key_end = key->key_offset + key->key_len;
+
+		/* Matches across two keys don't count */
+		if ((size_t)(match - bytes) + len > key_end) {
+			pos = match - bytes + 1;
+			continue;
+		}
+
+		if (set->count + key->count > alloc) {
+			uint64_t *tmp;
+
+			alloc = (set->count + key->count) * 2;
+			tmp = realloc(set->offsets, alloc * sizeof(*tmp));
+
+			if (tmp == NULL) {
+				fail(stderr, "%s: realloc failed\n", __func__);
+				free(folded);
+				free(set->offsets);
+				set->offsets = NULL;
+				return -1;
+			}
+
+			set->offsets = tmp;
+		}
+
+		set->count += posting_decode(pi, key, set->offsets + set->count);
+		pos = key_end;
+	}
+
+	free(folded);
+	set->count = offsets_sort_unique(set->offsets, set->count);
+
+	return 0;
+}
+
+
+/* Find the notes having all the pieces of word bytes of the search
+ * word, len bytes long. A note matching the search word has them all
+ * in its words.
+ *
+ * Returns 0 on success, -1 on failure and 1 if the word has no word
+ * bytes, it can be in any note then.
+ */
+static int word_index_word(const struct posting_index *pi,
+			   const unsigned char *word, size_t len,
+			   struct offset_set *set)
+{
+	struct offset_set piece_set;
+	int pieces = 0;
+	size_t i = 0;
+
+	set->offsets = NULL;
+	set->count = 0;
+
+	while (i < len) {
+		size_t piece_len = 0;
+
+		while (i < len && !is_word_byte(word[i]))
+			i++;
+
+		while (i + piece_len < len && is_word_byte(word[i + piece_len]))
+			piece_len++;
+
+		if (piece_len == 0)
+			break;
+
+		if (word_index_lookup(pi, word + i, piece_len, &piece_set) == -1) {
+			free(set->offsets);
+			return -1;
+		}
+
+		if (pieces++ == 0)
+			*set = piece_set;
+		else if (offset_set_merge(set, &piece_set, 1) == -1)
+			return -1;
+
+		i += piece_len;
+	}
+
+	return pieces == 0 ? 1 : 0;
+}
+
+
+/* Find the candidate notes for the search words using the word index.
+ * Candidates are notes having any, or all when match_all is set, of
+ * the words. They must still be checked against the words.
+ *
+ * Returns 0 on success, -1 if the index can't be used for the words.
+ */
+static int word_index_candidates(const struct posting_index *pi,
+				 const unsigned char **words,
+				 const size_t *words_len, size_t word_count,
+				 int match_all, struct offset_set *result)
+{
+	result->offsets = NULL;
+	result->count = 0;
+
+	for (size_t w = 0; w < word_count; w++) {
+		struct offset_set word_set;
+
+		if (word_index_word(pi, words[w], words_len[w], &word_set) != 0) {
+			free(result->offsets);
+			result->offsets = NULL;
+			return -1;
+		}
+
+		if (w == 0)
+			*result = word_set;
+		else if (offset_set_merge(result, &word_set, match_all) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/* Find where the last n lines of the file fd, size bytes long, start.
+ * The file is read backwards from the end in TAIL_BLOCK_SIZE blocks
+ * until n lines are found, so the cost does not depend on the size of
+ * the file. Empty lines are not counted.
+ *
+ * Returns the offset of the n-th last line, 0 if the file has n lines
+ * or less. On failure, returns -1.
+ */
+static off_t find_tail_start(int fd, off_t size, int n)
+{
+	char block[TAIL_BLOCK_SIZE];
+	off_t end = size;
+	int found = 0;
+
+	/* Byte following the one being looked at. New line character
+	 * at the end of the file does not start a line.
+	 */
+	char next = '\n';
+
+	if (n <= 0)
+		return size;
+
+	while (end > 0) {
+		off_t start = end > TAIL_BLOCK_SIZE ? end - TAIL_BLOCK_SIZE : 0;
+		ssize_t len = end - start;
+
+		if (memo_pread(fd, block, len, start) != len) {
+			fail(stderr, "%s: read failed\n", __func__);
+			return -1;
+		}
+
+		for (ssize_t i = len - 1; i >= 0; i--) {
+			if (block[i] == '\n' && next != '\n') {
+				found++;
+
+				if (found == n)
+					return start + i + 1;
+			}
+
+			next = block[i];
+		}
+
+		end = start;
+	}
+
+	return 0;
+}
+
+
+/* Read the id of the last note from the end of the .memo file and
+ * return it plus one. If the file is missing or is empty, return 1
+ * On error, returns -1
+ */
+static int get_next_id()
+{
+	char *path = NULL;
+	char buffer[32];
+	struct stat st;
+	off_t start;
+	ssize_t len;
+	int id = 0;
+	int fd;
+
+	path = get_memo_file_path();
+
+	if (path == NULL)
+		return -1;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if (fd == -1)
+		return id + 1;
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	start = find_tail_start(fd, st.st_size, 1);
+
+	if (start == -1) {
+		close(fd);
+		return -1;
+	}
+
+	/* Id is in the beginning of the line, no need to read more */
+	len = memo_pread(fd, buffer, sizeof(buffer), start);
+	close(fd);
+
+	if (len > 0) {
+		id = get_note_id_from_view(buffer, len);
+
+		if (id == -1)
+			id = 0;
+	}
+
+	return id + 1;
+}
+
+
+/* Leave out the notes which are known not to have the status of the
+ * scan. Malformed notes are kept, so they are reported as usual.
+ */
+static int status_scan_match(void *ctx, const struct line_view *note)
+{
+	struct status_scan *scan = ctx;
+	struct note_view view;
+
+	scan->lines++;
+
+	if (parse_note(note->str, note->len, &view) == -1)
+		return 1;
+
+	return view.status == scan->status;
+}
+
+
+/* Skip the notes before --offset with the .memo.idx index of the
+ * mapped memo file, without reading them. The index is built first if
+ * it's missing or out of date, so later pages are found without
+ * reading the memo file. Notes are counted the way show_notes shows
+ * them with status. *pos is set to the offset of the first note not
+ * skipped and *records to the count of records in the index.
+ *
+ * Returns the count of lines skipped, 0 if there's no index.
+ */
+static size_t memo_index_skip(const struct memo_map *map,
+			      NoteStatus_t status, size_t *pos,
+			      size_t *records)
+{
+	struct memo_index idx;
+	size_t i = 0;
+
+	if (memo_index_load(&idx, &map->st) == -1 &&
+	    memo_index_build(&idx, &map->st) == -1)
+		return 0;
+
+	for (; i < idx.header->count && output_is_skipping(); i++) {
+		char c = idx.records[i].status;
+
+		if (status == POSTPONED ? c == 'P' :
+		    status == UNDONE ? c == 'U' : c != 'P')
+			output_page.skipped++;
+	}
+
+	*pos = i < idx.header->count ? idx.records[i].offset : map->size;
+	*records = idx.header->count;
+
+	if (*pos > map->size)
+		*pos = map->size;
+
+	memo_index_close(&idx);
+
+	return i;
+}
+
+
+/* Show all notes. with status POSTPONED, postponed
+ * notes are shown. With status UNDONE, only undone
+ * notes are shown. Otherwise status is ignored and
+ * all notes are displayed.
+ *
+ * Returns the number of notes. Returns -1 on failure
+ */
+static int show_notes(NoteStatus_t status)
+{
+	struct memo_map map;
+	struct line_view line;
+	size_t pos = 0;
+	int count = 0;
+
+	/* Output count is used to calculate even and odd lines
+	 * when outputting undone or postponed notes.
+	 * When outputting normally, lines counts down from the last
+	 * line of the file, empty lines included. counted is the offset
+	 * where the new lines have been counted up to.
+	 */
+	int postponed_output_count = 0;
+	int undone_output_count = 0;
+	int lines = -1;
+	size_t counted = 0;
+
+	/* Notes left by parallel_scan */
+	struct line_view *hits = NULL;
+	size_t hit_count = 0;
+	size_t hit = 0;
+
+	if (memo_map_open(&map) == -1)
+		return -1;
+
+	/* Ignore empty note file and exit */
+	if (map.size == 0) {
+		fail(stderr,"You don't have any notes currently.\n");
+		memo_map_close(&map);
+		return -1;
+	}
+
+	/* Jump over the notes before --offset with the index. The
+	 * lines jumped over count for the odd and even lines as if
+	 * they were read.
+	 */
+	if (output_is_skipping()) {
+		size_t skipped = output_page.skipped;
+		size_t records = 0;
+
+		count = memo_index_skip(&map, status, &pos, &records);
+		skipped = output_page.skipped - skipped;
+
+		/* Memo doesn't write empty lines, so the index has a
+		 * record for each line.
+		 */
+		if (records > 0) {
+			lines = records - 1 - count;
+			counted = pos;
+		}
+
+		if (status == POSTPONED)
+			postponed_output_count = skipped;
+		else if (status == UNDONE)
+			undone_output_count = skipped;
+	}
+
+	if (status != POSTPONED && status != UNDONE && counted == 0)
+		lines = count_byte(map.data, map.size, '\n') - 1;
+
+	/* Notes with other status are left out on the threads. The
+	 * rest go through the loop below as usual.
+	 */
+	if (memo_opts.jobs > 1 && (status == POSTPONED || status == UNDONE)) {
+		struct status_scan *scans;
+
+		scans = calloc(memo_opts.jobs, sizeof(*scans));
+
+		if (scans == NULL) {
+			fail(stderr, "%s: malloc failed\n", __func__);
+			memo_map_close(&map);
+			return -1;
+		}
+
+		for (int i = 0; i < memo_opts.jobs; i++)
+			scans[i].status = status;
+
+		if (parallel_scan(&map, pos, memo_opts.jobs, status_scan_match,
+				  scans, sizeof(*scans), &hits,
+				  &hit_count) == -1) {
+			free(scans);
+			free(hits);
+			memo_map_close(&map);
+			return -1;
+		}
+
+		/* The loop below counts only the notes left */
+		for (int i = 0; i < memo_opts.jobs; i++)
+			count += scans[i].lines;
+
+		count -= hit_count;
+		free(scans);
+		pos = map.size;
+	}
+
+	while (!output_is_done() &&
+	       (hit < hit_count || memo_map_next_line(&map, &pos, &line))) {
+		if (hit < hit_count)
+			line = hits[hit++];
+
+		/* status is just used to know what kind of output we want.
+		 * we still need to check status the of the current line
+		 * separately.
+		 */
+		if (status == POSTPONED) {
+			if (get_note_status(line.str, line.len) == POSTPONED) {
+				postponed_output_count++;
+				int odd_p = is_odd(postponed_output_count);
+				output_postponed(line.str, line.len, odd_p);
+			}
+		}
+		else if (status == UNDONE) {
+			if (get_note_status(line.str, line.len) == UNDONE) {
+				undone_output_count++;
+				int odd_u = is_odd(undone_output_count);
+				output_undone(line.str, line.len, odd_u);
+			}
+		}
+		else {
+			lines -= count_byte(map.data + counted,
+					    line.str - map.data - counted, '\n');
+			counted = line.str - map.data;
+			output_default(line.str, line.len, is_odd(lines));
+		}
+
+		count++;
+	}
+
+	free(hits);
+	memo_map_close(&map);
+
+	return count;
+}
+
+
+/* Sort count records by packed date with a least significant digit
+ * radix sort, one byte of the date per pass. The sort is stable.
+ * *records and *tmp must both have room for count records, on return
+ * *records points to the sorted ones.
+ */
+static void sort_tree_records(struct tree_record **records,
+			      struct tree_record **tmp, size_t count)
+{
+	for (int shift = 0; shift < 32; shift += 8) {
+		struct tree_record *from = *records;
+		struct tree_record *to = *tmp;
+		size_t bucket[256] = { 0 };
+		size_t start = 0;
+
+		for (size_t i = 0; i < count; i++)
+			bucket[(from[i].packed_date >> shift) & 0xff]++;
+
+		/* Nothing to do if all the dates share this byte */
+		if (count == 0 ||
+		    bucket[(from[0].packed_date >> shift) & 0xff] == count)
+			continue;
+
+		for (int b = 0; b < 256; b++) {
+			size_t n = bucket[b];
+
+			bucket[b] = start;
+			start += n;
+		}
+
+		for (size_t i = 0; i < count; i++)
+			to[bucket[(from[i].packed_date >> shift) & 0xff]++] = from[i];
+
+		*records = to;
+		*tmp = from;
+	}
+}
+
+
+/* Function displays notes ordered by date.
+ *
+ * For example:
+ *
+ *   2014-11-01
+ *         1   U   Release Memo 1.3
+ *         2   D   Pay rent
+ *   2014-11-02
+ *         3   D   Go shopping
+ *
+ * Returns the count of the notes. On failure returns -1.
+ */
+static int show_notes_tree()
+{
+	struct memo_map map;
+	struct line_view line;
+	struct tree_record *records = NULL;
+	struct tree_record *sorted = NULL;
+	size_t alloc = 1024;
+	size_t count = 0;
+	size_t pos = 0;
+	int group = -1;
+	int header_group = -1;
+	uint32_t group_date = 0;
+	char date_str[DATE_STR_SIZE];
+
+	if (memo_map_open(&map) == -1)
+		return -1;
+
+	/* Ignore empty note file and exit */
+	if (map.size == 0) {
+		memo_map_close(&map);
+		return -1;
+	}
+
+	records = malloc(alloc * sizeof(*records));
+
+	if (records == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		memo_map_close(&map);
+		return -1;
+	}
+
+	/* Collect the packed date and the location of each note */
+	while (memo_map_next_line(&map, &pos, &line)) {
+		struct note_view note;
+
+		if (parse_note(line.str, line.len, &note) == -1 ||
+		    note.packed_date == 0) {
+			report_malformed_note(__func__, line.str, line.len);
+			continue;
+		}
+
+		if (count == alloc) {
+			struct tree_record *tmp;
+
+			alloc *= 2;
+			tmp = realloc(records, alloc * sizeof(*records));
+
+			if (tmp == NULL) {
+				fail(stderr, "%s: realloc failed\n", __func__);
+				free(records);
+				memo_map_close(&map);
+				return -1;
+			}
+
+			records = tmp;
+		}
+
+		records[count].packed_date = note.packed_date;
+		records[count].offset = line.str - map.data;
+		records[count].len = line.len;
+		count++;
+	}
+
+	sorted = malloc((count ? count : 1) * sizeof(*sorted));
+
+	if (sorted == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		free(records);
+		memo_map_close(&map);
+		return -1;
+	}
+
+	/* Notes of the same date keep their order in the file */
+	sort_tree_records(&records, &sorted, count);
+
+	for (size_t i = 0; i < count; i++) {
+		struct note_view note;
+
+		if (group == -1 || records[i].packed_date != group_date) {
+			group++;
+			group_date = records[i].packed_date;
+		}
+
+		if (output_is_done())
+			break;
+
+		/* A page of --offset may start in the middle of a group */
+		if (group != header_group && !output_is_skipping() &&
+		    memo_opts.format == FORMAT_TEXT &&
+		    memo_opts.count_mode == COUNT_OFF) {
+			header_group = group;
+			format_date(group_date, date_str);
+			output_write(date_str, strlen(date_str));
+			output_write("\n", 1);
+		}
+
+		parse_note(map.data + records[i].offset, records[i].len, &note);
+		output_without_date(&note, is_odd(group));
+	}
+
+	free(records);
+	free(sorted);
+	memo_map_close(&map);
+
+	return count;
+}
+
+
+/* Fold ASCII letters to lower case. Other bytes are kept as they are,
+ * like tolower does in the C locale.
+ */
+static unsigned char fold_byte(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+
+/* Compile len bytes of str into term for case insensitive matching
+ * with search_term_find. The folded needle is written to folded,
+ * which must have room for len bytes and outlive the term.
+ */
+static void search_term_compile(struct search_term *term, const char *str,
+				size_t len, unsigned char *folded)
+{
+	for (size_t i = 0; i < len; i++)
+		folded[i] = fold_byte((unsigned char)str[i]);
+
+	term->needle = folded;
+	term->len = len;
+
+	/* Horspool shift for each folded byte of the haystack when it
+	 * is under the last byte of the needle.
+	 */
+	for (int c = 0; c < 256; c++)
+		term->skip[c] = len;
+
+	for (size_t i = 0; i + 1 < len; i++)
+		term->skip[folded[i]] = len - 1 - i;
+
+	for (int c = 'A'; c <= 'Z'; c++)
+		term->skip[c] = term->skip[fold_byte(c)];
+}
+
+
+/* Find term from len bytes of haystack ignoring the case.
+ *
+ * Returns pointer to the match in haystack or NULL when not found.
+ */
+static const char *search_term_find(const struct search_term *term,
+				    const char *haystack, size_t len)
+{
+	const unsigned char *hay = (const unsigned char *)haystack;
+	const unsigned char *needle = term->needle;
+	size_t n = term->len;
+	size_t i = 0;
+
+	if (n == 0)
+		return haystack;
+
+	while (i + n <= len) {
+		unsigned char last = hay[i + n - 1];
+
+		if (fold_byte(last) == needle[n - 1]) {
+			size_t j = 0;
+
+			while (j + 1 < n && fold_byte(hay[i + j]) == needle[j])
+				j++;
+
+			if (j + 1 == n)
+				return haystack + i;
+		}
+
+		i += term->skip[last];
+	}
+
+	return NULL;
+}
+
+
+/* Build an Aho-Corasick automaton for count words. words[i] is
+ * words_len[i] bytes long and already folded to lower case. Words are
+ * matched ignoring the case.
+ *
+ * Returns 0 on success and -1 on failure. Caller must call
+ * term_matcher_free after calling the function successfully.
+ */
+static int term_matcher_build(struct term_matcher *m,
+			      const unsigned char **words,
+			      const size_t *words_len, size_t count)
+{
+	size_t total = 0;
+	int *queue = NULL;
+
+	memset(m, 0, sizeof(*m));
+
+	/* Each distinct byte of the words gets a class of its own */
+	m->class_count = 1;
+
+	for (size_t i = 0; i < count; i++) {
+		total += words_len[i];
+
+		for (size_t j = 0; j < words_len[i]; j++) {
+			if (m->class_of[words[i][j]] == 0)
+				m->class_of[words[i][j]] = m->class_count++;
+		}
+	}
+
+	for (int c = 'A'; c <= 'Z'; c++)
+		m->class_of[c] = m->class_of[fold_byte(c)];
+
+	/* The root and at most one state per byte of the words */
+	size_t max_states = total + 1;
+
+	m->next = malloc(max_states * m->class_count * sizeof(*m->next));
+	m->fail = calloc(max_states, sizeof(*m->fail));
+	m->output = malloc(max_states * sizeof(*m->output));
+	m->seen = calloc(max_states, sizeof(*m->seen));
+	queue = malloc(max_states * sizeof(*queue));
+
+	if (m->next == NULL || m->fail == NULL || m->output == NULL ||
+	    m->seen == NULL || queue == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		free(queue);
+		term_matcher_free(m);
+		return -1;
+	}
+
+	memset(m->next, -1, max_states * m->class_count * sizeof(*m->next));
+	m->state_count = 1;
+	m->output[0] = -1;
+
+	/* Insert the words to the trie */
+	for (size_t i = 0; i < count; i++) {
+		int state = 0;
+
+		for (size_t j = 0; j < words_len[i]; j++) {
+			int *to = &m->next[state * m->class_count +
+					   m->class_of[words[i][j]]];
+
+			if (*to == -1) {
+				m->output[m->state_count] = -1;
+				*to = m->state_count++;
+			}
+
+			state = *to;
+		}
+
+		/* The same word twice ends in the same state */
+		if (m->output[state] != state) {
+			m->output[state] = state;
+			m->term_count++;
+		}
+	}
+
+	/* Breadth first from the root, fill in the failure links and
+	 * turn the missing transitions to the ones of the failure state.
+	 */
+	int head = 0;
+	int tail = 0;
+
+	for (int c = 0; c < m->class_count; c++) {
+		int *to = &m->next[c];
+
+		if (*to == -1) {
+			*to = 0;
+		} else {
+			m->fail[*to] = 0;
+			queue[tail++] = *to;
+		}
+	}
+
+	while (head < tail) {
+		int state = queue[head++];
+
+		if (m->output[state] != state)
+			m->output[state] = m->output[m->fail[state]];
+
+		for (int c = 0; c < m->class_count; c++) {
+			int *to = &m->next[state * m->class_count + c];
+			int fallback = m->next[m->fail[state] * m->class_count + c];
+
+			if (*to == -1) {
+				*to = fallback;
+			} else {
+				m->fail[*to] = fallback;
+				queue[tail++] = *to;
+			}
+		}
+	}
+
+	free(queue);
+
+	return 0;
+}
+
+
+static void term_matcher_free(struct term_matcher *m)
+{
+	free(m->next);
+	free(m->fail);
+	free(m->output);
+	free(m->seen);
+	m->next = NULL;
+	m->fail = NULL;
+	m->output = NULL;
+	m->seen = NULL;
+}
+
+
+/* Check if len bytes of text contain any of the words, or all of them
+ * when match_all is set. Text is read once from left to right.
+ *
+ * Returns 1 on match and 0 otherwise.
+ */
+static int term_matcher_match(struct term_matcher *m, const char *text,
+			      size_t len, int match_all)
+{
+	const unsigned char *p = (const unsigned char *)text;
+	int found = 0;
+	int state = 0;
+
+	if (m->term_count == 0)
+		return 0;
+
+	m->record++;
+
+	for (size_t i = 0; i < len; i++) {
+		int out;
+
+		state = m->next[state * m->class_count + m->class_of[p[i]]];
+		out = m->output[state];
+
+		if (out == -1)
+			continue;
+
+		if (!match_all)
+			return 1;
+
+		/* Words ending here which were not seen in this record yet.
+		 * A seen word's shorter suffixes were counted with it.
+		 */
+		while (out != -1 && m->seen[out] != m->record) {
+			m->seen[out] = m->record;
+			found++;
+			out = m->output[m->fail[out]];
+		}
+
+		if (found == m->term_count)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* Open the posting index with given suffix for the mapped memo file.
+ * The index is built with build first if it's missing or not valid.
+ * It's rebuilt too when the notes appended after it was built have
+ * grown large compared to the indexed notes.
+ *
+ * Returns 0 on success, -1 if the index can't be used. Caller must
+ * call posting_index_close after calling the function successfully.
+ */
+static int posting_index_load(struct posting_index *pi, const char *suffix,
+			      const char *magic, const struct memo_map *map,
+			      int (*build)(const struct memo_map *map))
+{
+	for (int tries = 0; tries < 2; tries++) {
+		if (posting_index_open(pi, suffix, magic, &map->st) == 0) {
+			uint64_t tail = map->size - pi->header->indexed_size;
+
+			if (tail <= pi->header->indexed_size / 4 + 65536)
+				return 0;
+
+			posting_index_close(pi);
+		}
+
+		if (tries > 0 || build(map) == -1)
+			return -1;
+	}
+
+	return -1;
+}
+
+
+/* Find the key from the sorted keys of the posting index.
+ *
+ * Returns the key or NULL if it's not in the index.
+ */
+static const struct posting_key *posting_index_find(
+	const struct posting_index *pi, const unsigned char *key, size_t len)
+{
+	size_t lo = 0;
+	size_t hi = pi->header->key_count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct posting_key *k = &pi->keys[mid];
+		size_t n = k->key_len < len ? k->key_len : len;
+		int ret = memcmp(pi->key_bytes + k->key_offset, key, n);
+
+		if (ret == 0)
+			ret = (k->key_len > len) - (k->key_len < len);
+
+		if (ret == 0)
+			return k;
+
+		if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+
+/* Build the .memo.tri index of the mapped memo file. Every three
+ * consecutive bytes of every note are indexed in lower case.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int trigram_index_build(const struct memo_map *map)
+{
+	struct posting_builder b;
+	struct line_view line;
+	size_t pos = 0;
+	int ret = -1;
+
+	memset(&b, 0, sizeof(b));
+
+	while (memo_map_next_line(map, &pos, &line)) {
+		const unsigned char *p = (const unsigned char *)line.str;
+		uint64_t offset = line.str - map->data;
+
+		for (size_t i = 0; i + 3 <= line.len; i++) {
+			unsigned char trigram[3];
+
+			trigram[0] = fold_byte(p[i]);
+			trigram[1] = fold_byte(p[i + 1]);
+			trigram[2] = fold_byte(p[i + 2]);
+
+			if (posting_builder_add(&b, trigram, 3, offset) == -1)
+				goto out;
+		}
+	}
+
+	ret = posting_index_save(&b, ".tri", TRIGRAM_INDEX_MAGIC, &map->st,
+				 map->size);
+out:
+	posting_builder_free(&b);
+
+	return ret;
+}
+
+
+/* Skip the bracket expression starting at re[i], which must be '['.
+ * Returns the index after the closing ']'.
+ */
+static size_t skip_bracket(const char *re, size_t len, size_t i)
+{
+	i++;
+
+	if (i < len && re[i] == '^')
+		i++;
+
+	/* ] right after [ or [^ is part of the list */
+	if (i < len && re[i] == ']')
+		i++;
+
+	while (i < len && re[i] != ']') {
+		if (re[i] == '[' && i + 1 < len &&
+		    (re[i + 1] == ':' || re[i + 1] == '=' || re[i + 1] == '.')) {
+			char type = re[i + 1];
+
+			i += 2;
+
+			while (i + 1 < len && !(re[i] == type && re[i + 1] == ']'))
+				i++;
+
+			i += 2;
+		} else {
+			i++;
+		}
+	}
+
+	return i + 1;
+}
+
+
+/* Find the strings which every match of the basic regular expression
+ * re must contain. The strings are folded to lower case and written
+ * to buf, which must have room for strlen(re) bytes. The start and
+ * length of each are stored to starts and lens, which must have room
+ * for strlen(re) strings.
+ *
+ * Anything that's not a plain character ends the current string.
+ * Groups are skipped and a character followed by *, \? or an interval
+ * is left out, as they may match nothing. Alternation makes every
+ * string optional, so nothing is found then.
+ *
+ * Returns the count of strings found.
+ */
+static size_t regexp_literals(const char *re, unsigned char *buf,
+			      size_t *starts, size_t *lens)
+{
+	size_t len = strlen(re);
+	size_t count = 0;
+	size_t out = 0;
+	size_t run = 0;
+	size_t i = 0;
+
+	if (strstr(re, "\\|") != NULL)
+		return 0;
+
+#define END_RUN() do { \
+		if (run > 0) { \
+			starts[count] = out - run; \
+			lens[count++] = run; \
+		} \
+		run = 0; \
+	} while (0)
+
+#define DROP_LAST() do { \
+		if (run > 0) { \
+			out--; \
+			run--; \
+		} \
+	} while (0)
+
+	while (i < len) {
+		char c = re[i];
+
+		if (c == '\\' && i + 1 < len) {
+			char d = re[i + 1];
+
+			if (d == '(') {
+				int depth = 1;
+
+				END_RUN();
+				i += 2;
+
+				while (i < len && depth > 0) {
+					if (re[i] == '[') {
+						i = skip_bracket(re, len, i);
+					} else if (re[i] == '\\' && i + 1 < len) {
+						if (re[i + 1] == '(')
+							depth++;
+						else if (re[i + 1] == ')')
+							depth--;
+						i += 2;
+					} else {
+						i++;
+					}
+				}
+			} else if (d == '{') {
+				DROP_LAST();
+				END_RUN();
+
+				while (i + 1 < len &&
+				       !(re[i] == '\\' && re[i + 1] == '}'))
+					i++;
+
+				i += 2;
+			} else if (d == '?') {
+				DROP_LAST();
+				END_RUN();
+				i += 2;
+			} else if (isalnum((unsigned char)d) || d == '<' ||
+				   d == '>' || d == '`' || d == '\'' ||
+				   d == '+' || d == ')') {
+				/* Back references, classes and anchors */
+				END_RUN();
+				i += 2;
+			} else {
+				buf[out++] = fold_byte(d);
+				run++;
+				i += 2;
+			}
+		} else if (c == '[') {
+			END_RUN();
+			i = skip_bracket(re, len, i);
+		} else if (c == '*') {
+			DROP_LAST();
+			END_RUN();
+			i++;
+		} else if (c == '.' || c == '^' || c == '$' || c == '\\') {
+			END_RUN();
+			i++;
+		} else {
+			buf[out++] = fold_byte(c);
+			run++;
+			i++;
+		}
+	}
+
+	END_RUN();
+
+#undef END_RUN
+#undef DROP_LAST
+
+	return count;
+}
+
+
+/* Find the candidate notes for the basic regular expression re with
+ * the trigram index. Candidates have every trigram of every string the
+ * matches must contain, see regexp_literals. They must still be
+ * checked against the regular expression.
+ *
+ * Returns 0 on success, -1 if the index can't be used for re.
+ */
+static int trigram_index_candidates(const struct posting_index *pi,
+				    const char *re, struct offset_set *result)
+{
+	size_t len = strlen(re);
+	unsigned char *buf = malloc(len + 1);
+	size_t *starts = malloc((len + 1) * sizeof(*starts));
+	size_t *lens = malloc((len + 1) * sizeof(*lens));
+	size_t count;
+	int trigrams = 0;
+	int ret = -1;
+
+	result->offsets = NULL;
+	result->count = 0;
+
+	if (buf == NULL || starts == NULL || lens == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		goto out;
+	}
+
+	count = regexp_literals(re, buf, starts, lens);
+
+	for (size_t s = 0; s < count; s++) {
+		for (size_t i = 0; i + 3 <= lens[s]; i++) {
+			const struct posting_key *key;
+			struct offset_set set;
+
+			key = posting_index_find(pi, buf + starts[s] + i, 3);
+
+			/* No note has the trigram */
+			if (key == NULL) {
+				free(result->offsets);
+				result->offsets = NULL;
+				result->count = 0;
+				ret = 0;
+				goto out;
+			}
+
+			set.offsets = malloc((key->count + 1) * sizeof(*set.offsets));
+
+			if (set.offsets == NULL) {
+				fail(stderr, "%s: malloc failed\n", __func__);
+				free(result->offsets);
+				result->offsets = NULL;
+				goto out;
+			}
+
+			set.count = posting_decode(pi, key, set.offsets);
+
+			if (trigrams++ == 0)
+				*result = set;
+			else if (offset_set_merge(result, &set, 1) == -1)
+				goto out;
+		}
+	}
+
+	/* Nothing to narrow the search down with */
+	ret = trigrams > 0 ? 0 : -1;
+out:
+	free(buf);
+	free(starts);
+	free(lens);
+
+	return ret;
+}
+
+
+/* Get the note starting at offset of the mapped memo file to note.
+ *
+ * Returns 0 on success, -1 if no note starts at offset.
+ */
+static int memo_map_line_at(const struct memo_map *map, uint64_t offset,
+			    struct line_view *note)
+{
+	const char *nl;
+
+	if (offset >= map->size ||
+	    (offset > 0 && map->data[offset - 1] != '\n'))
+		return -1;
+
+	note->str = map->data + offset;
+	nl = scan_byte(note->str, map->size - offset, '\n');
+	note->len = nl ? (size_t)(nl - note->str) : map->size - offset;
+
+	return 0;
+}
+
+
+/* Scan the notes in the part of the memo file given to the job and
+ * collect the ones match accepts. Run on a thread of its own.
+ */
+static void *scan_job_run(void *arg)
+{
+	struct scan_job *job = arg;
+	struct memo_map part = *job->map;
+	struct line_view line;
+	size_t pos = job->start;
+
+	/* Lines of the part end at the start of the next part */
+	part.size = job->end;
+
+	while (memo_map_next_line(&part, &pos, &line)) {
+		int ret = job->match(job->ctx, &line);
+
+		if (ret == -1) {
+			job->failed = 1;
+			break;
+		}
+
+		if (ret == 0)
+			continue;
+
+		if (job->hit_count == job->hit_alloc) {
+			size_t alloc = job->hit_alloc ? job->hit_alloc * 2 : 256;
+			struct line_view *tmp;
+
+			tmp = realloc(job->hits, alloc * sizeof(*tmp));
+
+			if (tmp == NULL) {
+				job->failed = 1;
+				break;
+			}
+
+			job->hits = tmp;
+			job->hit_alloc = alloc;
+		}
+
+		job->hits[job->hit_count++] = line;
+	}
+
+	return NULL;
+}
+
+
+/* Scan the notes of the mapped memo file from offset start to the end
+ * with jobs threads. The file is split to jobs parts at line
+ * boundaries. Each thread calls match for the notes of its part with
+ * its own context, ctxs is an array of jobs contexts, ctx_size bytes
+ * each. match returns 1 to accept the note, 0 to skip it and -1 to
+ * stop the scan.
+ *
+ * The accepted notes are stored to *hits in the order of the memo file,
+ * so they can be shown the same way as when scanning sequentially.
+ * Caller must free *hits.
+ *
+ * Returns 0 on success, -1 on failure. Notes accepted before the scan
+ * was stopped are stored to *hits in both cases.
+ */
+static int parallel_scan(const struct memo_map *map, size_t start, int jobs,
+			 scan_match_fn match, void *ctxs, size_t ctx_size,
+			 struct line_view **hits, size_t *hit_count)
+{
+	struct scan_job *job = calloc(jobs, sizeof(*job));
+	size_t total = 0;
+	size_t bound = start;
+	int ret = 0;
+
+	*hits = NULL;
+	*hit_count = 0;
+
+	if (job == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	for (int i = 0; i < jobs; i++) {
+		size_t end = start + (map->size - start) / jobs * (i + 1);
+
+		/* Move the end of the part after the next new line */
+		if (i == jobs - 1 || end <= bound) {
+			end = i == jobs - 1 ? map->size : bound;
+		} else {
+			const char *nl = scan_byte(map->data + end - 1,
+						   map->size - end + 1, '\n');
+
+			end = nl ? (size_t)(nl - map->data) + 1 : map->size;
+		}
+
+		job[i].map = map;
+		job[i].start = bound;
+		job[i].end = end;
+		job[i].match = match;
+		job[i].ctx = (char *)ctxs + i * ctx_size;
+		bound = end;
+
+		/* Scan the part here if there's no thread for it */
+		if (pthread_create(&job[i].thread, NULL, scan_job_run,
+				   &job[i]) != 0) {
+			scan_job_run(&job[i]);
+			job[i].inline_run = 1;
+		}
+	}
+
+	for (int i = 0; i < jobs; i++) {
+		if (!job[i].inline_run)
+			pthread_join(job[i].thread, NULL);
+
+		total += job[i].hit_count;
+	}
+
+	*hits = malloc((total + 1) * sizeof(**hits));
+
+	if (*hits == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		ret = -1;
+	}
+
+	for (int i = 0; i < jobs; i++) {
+		if (*hits && ret == 0) {
+			memcpy(*hits + *hit_count, job[i].hits,
+			       job[i].hit_count * sizeof(**hits));
+			*hit_count += job[i].hit_count;
+		}
+
+		/* Later parts don't count after a part failed */
+		if (job[i].failed)
+			ret = -1;
+
+		free(job[i].hits);
+	}
+
+	free(job);
+
+	return ret;
+}
+
+
+/* Check if the note matches the compiled search words of search_notes.
+ * A single word is in term, more words are in matcher.
+ */
+static int search_matches(const struct search_term *term,
+			  struct term_matcher *matcher, size_t word_count,
+			  const struct line_view *note)
+{
+	if (word_count == 1)
+		return search_term_find(term, note->str, note->len) != NULL;
+
+	return term_matcher_match(matcher, note->str, note->len,
+				  memo_opts.match_all);
+}
+
+
+static int search_scan_match(void *ctx, const struct line_view *note)
+{
+	struct search_scan *scan = ctx;
+
+	return search_matches(scan->term, &scan->matcher, scan->word_count,
+			      note);
+}
+
+
+/* Check the notes of the mapped memo file from offset start to the end
+ * for the search words with memo_opts.jobs threads and show the
+ * matching ones. count is the count of notes shown before.
+ *
+ * Returns the count of notes shown, or -1 on failure.
+ */
+static int search_notes_parallel(const struct memo_map *map, size_t start,
+				 const struct search_term *term,
+				 const unsigned char **words,
+				 const size_t *words_len, size_t word_count,
+				 int count)
+{
+	struct search_scan *scans;
+	struct line_view *hits = NULL;
+	size_t hit_count = 0;
+	int built = 0;
+	int ret = 0;
+
+	scans = calloc(memo_opts.jobs, sizeof(*scans));
+
+	if (scans == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	/* The matcher remembers the words seen, so each thread needs
+	 * one of its own.
+	 */
+	for (; built < memo_opts.jobs; built++) {
+		scans[built].term = term;
+		scans[built].word_count = word_count;
+
+		if (word_count != 1 &&
+		    term_matcher_build(&scans[built].matcher, words, words_len,
+				       word_count) == -1) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	ret = parallel_scan(map, start, memo_opts.jobs, search_scan_match,
+			    scans, sizeof(*scans), &hits, &hit_count);
+
+	for (size_t i = 0; i < hit_count; i++) {
+		output_default(hits[i].str, hits[i].len, is_odd(count));
+		count++;
+	}
+
+	free(hits);
+out:
+	for (int i = 0; i < built; i++) {
+		if (word_count != 1)
+			term_matcher_free(&scans[i].matcher);
+	}
+
+	free(scans);
+
+	return ret == -1 ? -1 : count;
+}
+
+
+/* Find the candidate notes for the search words with the .memo.words
+ * index of the mapped memo file, see posting_index_load.
+ *
+ * On success the candidates are stored to result and the offset where
+ * the notes not in the index start to indexed_end. Caller must free
+ * result->offsets.
+ *
+ * Returns 0 on success, -1 if the memo file must be scanned instead.
+ */
+static int word_index_search(const struct memo_map *map,
+			     const unsigned char **words,
+			     const size_t *words_len, size_t word_count,
+			     struct offset_set *result, size_t *indexed_end)
+{
+	struct posting_index pi;
+	int ret;
+
+	if (posting_index_load(&pi, ".words", WORD_INDEX_MAGIC, map,
+			       word_index_build) == -1)
+		return -1;
+
+	ret = word_index_candidates(&pi, words, words_len, word_count,
+				    memo_opts.match_all, result);
+
+	if (ret == 0)
+		*indexed_end = pi.header->indexed_size;
+
+	posting_index_close(&pi);
+
+	return ret;
+}
+
+
+/* Count of days from 1970-01-01 to the packed date */
+static long date_to_days(uint32_t packed)
+{
+	long y = packed / 10000;
+	long m = packed / 100 % 100;
+	long d = packed % 100;
+	long era, yoe, doy;
+
+	/* Count years from March, so the leap day is the last day */
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+
+/* Comparator for qsort, orders positions of the words in the note */
+static int rank_pos_sort(const void *a, const void *b)
+{
+	const struct rank_pos *x = a;
+	const struct rank_pos *y = b;
+
+	return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+
+/* Score the content of the note for rank_notes. The score is the sum of
+ *
+ *   2 for each search word found
+ *   tf / (tf + 1) for each word found tf times
+ *   1 / (1 + gap / 8) for the smallest gap between two different words
+ *   1 / (1 + age / 30) for the age of the note in days
+ *
+ * so notes with more of the words always rank first. r->pos is used
+ * to sort the positions of the words and grown when needed.
+ */
+static double rank_score(struct rank_state *r, const struct note_view *note)
+{
+	const char *content = note->content.str;
+	size_t len = note->content.len;
+	size_t pos_count = 0;
+	size_t found = 0;
+	double score = 0;
+	long age;
+
+	for (size_t w = 0; w < r->word_count; w++) {
+		const struct search_term *term = &r->terms[w];
+		size_t tf = 0;
+		size_t i = 0;
+		const char *hit;
+
+		while (i < len &&
+		       (hit = search_term_find(term, content + i, len - i))) {
+			size_t at = hit - content;
+
+			if (pos_count == r->pos_alloc) {
+				size_t n = r->pos_alloc ? r->pos_alloc * 2 : 64;
+				struct rank_pos *tmp;
+
+				tmp = realloc(r->pos, n * sizeof(*tmp));
+
+				/* Without room the proximity is estimated
+				 * from the positions stored so far.
+				 */
+				if (tmp) {
+					r->pos = tmp;
+					r->pos_alloc = n;
+				}
+			}
+
+			if (pos_count < r->pos_alloc) {
+				r->pos[pos_count].pos = at;
+				r->pos[pos_count].word = w;
+				pos_count++;
+			}
+
+			tf++;
+			i = at + term->len;
+		}
+
+		if (tf > 0) {
+			found++;
+			score += 2 + (double)tf / (tf + 1);
+		}
+	}
+
+	if (found > 1) {
+		size_t gap = len;
+
+		qsort(r->pos, pos_count, sizeof(*r->pos), rank_pos_sort);
+
+		for (size_t i = 1; i < pos_count; i++) {
+			const struct rank_pos *a = &r->pos[i - 1];
+			const struct rank_pos *b = &r->pos[i];
+			size_t end = a->pos + r->terms[a->word].len;
+
+			if (a->word == b->word)
+				continue;
+
+			if (b->pos <= end)
+				gap = 0;
+			else if (b->pos - end < gap)
+				gap = b->pos - end;
+		}
+
+		score += 1 / (1 + gap / 8.0);
+	}
+
+	if (note->packed_date != 0) {
+		age = r->today - date_to_days(note->packed_date);
+		score += 1 / (1 + (age > 0 ? age : 0) / 30.0);
+	}
+
+	return score;
+}
+
+
+/* Check if hit a ranks before hit b. Notes earlier in the memo file
+ * rank first when the score is the same.
+ */
+static int rank_hit_better(const struct rank_hit *a, const struct rank_hit *b)
+{
+	if (a->score != b->score)
+		return a->score > b->score;
+
+	return a->order < b->order;
+}
+
+
+/* Comparator for qsort, orders the hits best first */
+static int rank_hit_sort(const void *a, const void *b)
+{
+	return rank_hit_better(a, b) ? -1 : rank_hit_better(b, a);
+}
+
+
+/* Keep the hit if it's among the best r->limit hits so far. The hits
+ * are a binary heap with the worst kept hit at the top, so a hit is
+ * either dropped or replaces the top in O(log limit) time.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int rank_heap_push(struct rank_state *r, const struct rank_hit *hit)
+{
+	size_t i;
+
+	if (r->hit_count == r->limit) {
+		if (!rank_hit_better(hit, &r->hits[0]))
+			return 0;
+
+		/* Sift the new hit down from the top */
+		i = 0;
+
+		for (;;) {
+			size_t child = 2 * i + 1;
+
+			if (child >= r->hit_count)
+				break;
+
+			if (child + 1 < r->hit_count &&
+			    rank_hit_better(&r->hits[child], &r->hits[child + 1]))
+				child++;
+
+			if (!rank_hit_better(hit, &r->hits[child]))
+				break;
+
+			r->hits[i] = r->hits[child];
+			i = child;
+		}
+
+		r->hits[i] = *hit;
+
+		return 0;
+	}
+
+	if (r->hit_count == r->hit_alloc) {
+		size_t n = r->hit_alloc ? r->hit_alloc * 2 : 64;
+		struct rank_hit *tmp;
+
+		if (n > r->limit)
+			n = r->limit;
+
+		tmp = realloc(r->hits, n * sizeof(*tmp));
+
+		if (tmp == NULL) {
+			fail(stderr, "%s: malloc failed\n", __func__);
+			return -1;
+		}
+
+		r->hits = tmp;
+		r->hit_alloc = n;
+	}
+
+	/* Sift the new hit up from the bottom */
+	i = r->hit_count++;
+
+	while (i > 0 && rank_hit_better(&r->hits[(i - 1) / 2], hit)) {
+		r->hits[i] = r->hits[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+
+	r->hits[i] = *hit;
+
+	return 0;
+}
+
+
+/* Show the memo_opts.rank best notes of the mapped memo file matching
+ * the search words of search_notes, best first, see rank_score. Only
+ * the best notes found so far are kept in memory.
+ *
+ * Returns the count of notes shown or -1 if function fails.
+ */
+static int rank_notes(const struct memo_map *map,
+		      const struct search_term *term,
+		      struct term_matcher *matcher,
+		      const unsigned char **words, const size_t *words_len,
+		      size_t word_count)
+{
+	struct rank_state r;
+	struct line_view line;
+	struct note_view note;
+	unsigned char *folded;
+	size_t folded_len = 0;
+	size_t order = 0;
+	size_t pos = 0;
+	time_t t = time(NULL);
+	struct tm *tm = localtime(&t);
+	int count = 0;
+
+	memset(&r, 0, sizeof(r));
+	r.word_count = word_count;
+	r.limit = memo_opts.rank;
+
+	for (size_t i = 0; i < word_count; i++)
+		folded_len += words_len[i];
+
+	r.terms = malloc(word_count * sizeof(*r.terms));
+	folded = malloc(folded_len + 1);
+
+	if (r.terms == NULL || folded == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		free(r.terms);
+		free(folded);
+		return -1;
+	}
+
+	folded_len = 0;
+
+	for (size_t i = 0; i < word_count; i++) {
+		search_term_compile(&r.terms[i], (const char *)words[i],
+				    words_len[i], folded + folded_len);
+		folded_len += words_len[i];
+	}
+
+	if (tm)
+		r.today = date_to_days((tm->tm_year + 1900) * 10000 +
+				       (tm->tm_mon + 1) * 100 + tm->tm_mday);
+
+	while (memo_map_next_line(map, &pos, &line)) {
+		struct rank_hit hit;
+
+		if (!search_matches(term, matcher, word_count, &line))
+			continue;
+
+		/* Postponed notes are not shown by -f */
+		if (parse_note(line.str, line.len, &note) == -1 ||
+		    note.status == POSTPONED)
+			continue;
+
+		hit.score = rank_score(&r, &note);
+		hit.order = order++;
+		hit.line = line;
+
+		if (rank_heap_push(&r, &hit) == -1) {
+			count = -1;
+			break;
+		}
+	}
+
+	if (count != -1 && r.hit_count > 0) {
+		qsort(r.hits, r.hit_count, sizeof(*r.hits), rank_hit_sort);
+
+		for (size_t i = 0; i < r.hit_count; i++) {
+			output(r.hits[i].line.str, r.hits[i].line.len,
+			       is_odd(count));
+			count++;
+		}
+	}
+
+	free(r.terms);
+	free(r.pos);
+	free(r.hits);
+	free(folded);
+
+	return count;
+}
+
+
+/* Search if a note contains any of the space separated words of the
+ * search term, or all of them with --all, ignoring the case. With
+ * --fuzzy the search is done by fuzzy_search_notes and with --rank the
+ * found notes are shown by rank_notes.
+ * Returns the count of found notes or -1 if function fails.
+ */
+static int search_notes(const char *search)
+{
+	struct memo_map map;
+	struct line_view view;
+	struct search_term term;
+	struct term_matcher matcher;
+	struct offset_set candidates;
+	const unsigned char **words = NULL;
+	size_t *words_len = NULL;
+	unsigned char *folded = NULL;
+	size_t word_count = 0;
+	size_t search_len = strlen(search);
+	size_t pos = 0;
+	int count = 0;
+
+	if (memo_opts.fuzzy)
+		return fuzzy_search_notes(search);
+
+	/* Split the search term to words once. There can't be more
+	 * words than every other byte.
+	 */
+	words = malloc((search_len / 2 + 1) * sizeof(*words));
+	words_len = malloc((search_len / 2 + 1) * sizeof(*words_len));
+	folded = malloc(search_len + 1);
+
+	if (words == NULL || words_len == NULL || folded == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		free(words);
+		free(words_len);
+		free(folded);
+		return -1;
+	}
+
+	for (size_t i = 0; i < search_len; i++)
+		folded[i] = fold_byte((unsigned char)search[i]);
+
+	for (size_t i = 0; i < search_len; ) {
+		size_t len = 0;
+
+		while (i < search_len && search[i] == ' ')
+			i++;
+
+		while (i + len < search_len && search[i + len] != ' ')
+			len++;
+
+		if (len > 0) {
+			words[word_count] = folded + i;
+			words_len[word_count] = len;
+			word_count++;
+		}
+
+		i += len;
+	}
+
+	/* A single word is faster to find with the skip table, more
+	 * words are all looked for at once.
+	 */
+	if (word_count == 1)
+		search_term_compile(&term, search + (words[0] - folded),
+				    words_len[0], folded + (words[0] - folded));
+	else if (term_matcher_build(&matcher, words, words_len,
+				    word_count) == -1) {
+		count = -1;
+		goto out;
+	}
+
+	if (memo_map_open(&map) == -1) {
+		count = -1;
+		goto out_matcher;
+	}
+
+	/* Ignore empty note file and exit */
+	if (map.size == 0) {
+		memo_map_close(&map);
+		count = -1;
+		goto out_matcher;
+	}
+
+	if (memo_opts.rank > 0) {
+		count = rank_notes(&map, &term, &matcher, words, words_len,
+				   word_count);
+		memo_map_close(&map);
+		goto out_matcher;
+	}
+
+	/* With the word index only the candidate notes and the notes
+	 * appended after the index was built need to be checked.
+	 */
+	if (search_index_enabled() &&
+	    word_index_search(&map, words, words_len, word_count,
+			      &candidates, &pos) == 0) {
+		for (size_t i = 0; i < candidates.count && !output_is_done();
+		     i++) {
+			if (candidates.offsets[i] >= pos ||
+			    memo_map_line_at(&map, candidates.offsets[i],
+					     &view) == -1)
+				continue;
+
+			if (search_matches(&term, &matcher, word_count, &view)) {
+				output_default(view.str, view.len, is_odd(count));
+				count++;
+			}
+		}
+
+		free(candidates.offsets);
+	}
+
+	if (memo_opts.jobs > 1) {
+		count = search_notes_parallel(&map, pos, &term, words, words_len,
+					      word_count, count);
+		pos = map.size;
+	}
+
+	while (!output_is_done() && memo_map_next_line(&map, &pos, &view)) {
+		if (search_matches(&term, &matcher, word_count, &view)) {
+			output_default(view.str, view.len, is_odd(count));
+			count++;
+		}
+	}
+
+	memo_map_close(&map);
+
+out_matcher:
+	if (word_count != 1)
+		term_matcher_free(&matcher);
+out:
+	free(words);
+	free(words_len);
+	free(folded);
+
+	return count;
+}
+
+
+/* Compile the search of --fuzzy for fuzzy_distance. peq gets a bit set
+ * for each position of the search where the byte is, ignoring the case.
+ *
+ * Returns 0 on success, -1 if the search is empty or too long.
+ */
+static int fuzzy_pattern_compile(struct fuzzy_pattern *fp, const char *str,
+				 int max_distance)
+{
+	size_t len = strlen(str);
+
+	if (len == 0 || len > FUZZY_MAX_LEN) {
+		fail(stderr, "%s: search must be 1 to %d bytes long\n",
+			__func__, FUZZY_MAX_LEN);
+		return -1;
+	}
+
+	memset(fp->peq, 0, sizeof(fp->peq));
+	fp->len = len;
+	fp->max_distance = max_distance;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = fold_byte((unsigned char)str[i]);
+
+		fp->peq[c] |= (uint64_t)1 << i;
+
+		if (c >= 'a' && c <= 'z')
+			fp->peq[c - ('a' - 'A')] |= (uint64_t)1 << i;
+	}
+
+	return 0;
+}
+
+
+/* Find the smallest edit distance between the pattern and any part of
+ * len bytes of text with the bit-parallel algorithm of Myers. A column
+ * of the edit distance matrix is kept as bit vectors of the vertical
+ * deltas pv and mv, so each byte of text costs a few word operations
+ * instead of a pass over the pattern.
+ *
+ * Returns the distance, or max + 1 when it's larger than max.
+ */
+static int fuzzy_distance(const struct fuzzy_pattern *fp, const char *text,
+			  size_t len, int max)
+{
+	const unsigned char *t = (const unsigned char *)text;
+	uint64_t last = (uint64_t)1 << (fp->len - 1);
+	uint64_t pv = ~(uint64_t)0;
+	uint64_t mv = 0;
+	int score = (int)fp->len;
+	int best = score;
+
+	for (size_t i = 0; i < len && best > 0; i++) {
+		uint64_t eq = fp->peq[t[i]];
+		uint64_t xv = eq | mv;
+		uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint64_t ph = mv | ~(xh | pv);
+		uint64_t mh = pv & xh;
+
+		if (ph & last)
+			score++;
+		else if (mh & last)
+			score--;
+
+		/* A match can start anywhere in the text, so the first
+		 * row of the matrix stays zero.
+		 */
+		ph <<= 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+
+		if (score < best)
+			best = score;
+	}
+
+	return best > max ? max + 1 : best;
+}
+
+
+/* Edit distance between the --fuzzy search and the content of the
+ * note, or max_distance + 1 if the note is not valid.
+ */
+static int fuzzy_note_distance(const struct fuzzy_pattern *fp,
+			       const struct line_view *line)
+{
+	struct note_view note;
+
+	if (parse_note(line->str, line->len, &note) == -1)
+		return fp->max_distance + 1;
+
+	return fuzzy_distance(fp, note.content.str, note.content.len,
+			      fp->max_distance);
+}
+
+
+static int fuzzy_scan_match(void *ctx, const struct line_view *note)
+{
+	const struct fuzzy_pattern *fp = ctx;
+
+	return fuzzy_note_distance(fp, note) <= fp->max_distance;
+}
+
+
+/* Add a note found by fuzzy_search_notes to hits.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int fuzzy_hit_add(struct fuzzy_hit **hits, size_t *count,
+			 size_t *alloc, const struct line_view *line,
+			 int distance)
+{
+	if (*count == *alloc) {
+		size_t n = *alloc ? *alloc * 2 : 256;
+		struct fuzzy_hit *tmp = realloc(*hits, n * sizeof(*tmp));
+
+		if (tmp == NULL) {
+			fail(stderr, "%s: malloc failed\n", __func__);
+			return -1;
+		}
+
+		*hits = tmp;
+		*alloc = n;
+	}
+
+	(*hits)[*count].line = *line;
+	(*hits)[*count].distance = distance;
+	(*count)++;
+
+	return 0;
+}
+
+
+/* Search notes whose content contains the search with at most
+ * memo_opts.max_distance inserted, deleted or changed bytes, ignoring
+ * the case. The notes are shown the closest ones first and in the
+ * order of the memo file when the distance is the same.
+ *
+ * Returns the count of found notes or -1 if function fails.
+ */
+static int fuzzy_search_notes(const char *search)
+{
+	struct fuzzy_pattern fp;
+	struct memo_map map;
+	struct line_view line;
+	struct line_view *scanned = NULL;
+	struct fuzzy_hit *hits = NULL;
+	size_t scanned_count = 0;
+	size_t hit_count = 0;
+	size_t hit_alloc = 0;
+	size_t pos = 0;
+	int count = 0;
+
+	if (fuzzy_pattern_compile(&fp, search, memo_opts.max_distance) == -1)
+		return -1;
+
+	if (memo_map_open(&map) == -1)
+		return -1;
+
+	/* The threads share the pattern and only filter the notes, the
+	 * distance of the few notes found is computed again here.
+	 */
+	if (memo_opts.jobs > 1) {
+		if (parallel_scan(&map, 0, memo_opts.jobs, fuzzy_scan_match,
+				  &fp, 0, &scanned, &scanned_count) == -1)
+			count = -1;
+
+		pos = map.size;
+	}
+
+	for (size_t i = 0; i < scanned_count && count != -1; i++) {
+		if (fuzzy_hit_add(&hits, &hit_count, &hit_alloc, &scanned[i],
+				  fuzzy_note_distance(&fp, &scanned[i])) == -1)
+			count = -1;
+	}
+
+	while (count != -1 && memo_map_next_line(&map, &pos, &line)) {
+		int distance = fuzzy_note_distance(&fp, &line);
+
+		if (distance <= fp.max_distance &&
+		    fuzzy_hit_add(&hits, &hit_count, &hit_alloc, &line,
+				  distance) == -1)
+			count = -1;
+	}
+
+	/* There are only a few distances, so show the notes with a pass
+	 * for each of them.
+	 */
+	for (int d = 0; d <= fp.max_distance && count != -1; d++) {
+		for (size_t i = 0; i < hit_count; i++) {
+			if (hits[i].distance != d)
+				continue;
+
+			output_default(hits[i].line.str, hits[i].line.len,
+				       is_odd(count));
+			count++;
+		}
+	}
+
+	free(scanned);
+	free(hits);
+	memo_map_close(&map);
+
+	return count;
+}
+
+
+/* Find the candidate notes for the regular expression with the
+ * .memo.tri index of the mapped memo file, see posting_index_load.
+ *
+ * On success the candidates are stored to result and the offset where
+ * the notes not in the index start to indexed_end. Caller must free
+ * result->offsets.
+ *
+ * Returns 0 on success, -1 if the memo file must be scanned instead.
+ */
+static int trigram_index_search(const struct memo_map *map, const char *re,
+				struct offset_set *result, size_t *indexed_end)
+{
+	struct posting_index pi;
+	int ret;
+
+	if (posting_index_load(&pi, ".tri", TRIGRAM_INDEX_MAGIC, map,
+			       trigram_index_build) == -1)
+		return -1;
+
+	ret = trigram_index_candidates(&pi, re, result);
+
+	if (ret == 0)
+		*indexed_end = pi.header->indexed_size;
+
+	posting_index_close(&pi);
+
+	return ret;
+}
+
+
+static int regexp_scan_match(void *ctx, const struct line_view *note)
+{
+	struct regexp_scan *scan = ctx;
+	int ret;
+
+	if (line_view_to_string(note, &scan->line, &scan->line_size) == NULL)
+		return -1;
+
+	ret = regexec(&scan->regex, scan->line, 0, NULL, 0);
+
+	if (ret == 0)
+		return 1;
+
+	if (ret == REG_NOMATCH)
+		return 0;
+
+	scan->error = ret;
+
+	return -1;
+}
+
+
+/* Check the notes of the mapped memo file from offset start to the end
+ * against the regular expression with memo_opts.jobs threads and show
+ * the matching ones. count is the count of notes shown before.
+ *
+ * Returns the count of notes shown, or -1 on failure.
+ */
+static int search_regexp_parallel(const struct memo_map *map, size_t start,
+				  const char *regexp, int count)
+{
+	struct regexp_scan *scans;
+	struct line_view *hits = NULL;
+	size_t hit_count = 0;
+	char buffer[100];
+	int compiled = 0;
+	int ret = 0;
+
+	scans = calloc(memo_opts.jobs, sizeof(*scans));
+
+	if (scans == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		return -1;
+	}
+
+	/* Each thread matches with a compiled expression of its own */
+	for (; compiled < memo_opts.jobs; compiled++) {
+		if (regcomp(&scans[compiled].regex, regexp, REG_ICASE) != 0) {
+			fail(stderr, "%s: invalid regexp\n", __func__);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	ret = parallel_scan(map, start, memo_opts.jobs, regexp_scan_match,
+			    scans, sizeof(*scans), &hits, &hit_count);
+
+	for (size_t i = 0; i < hit_count; i++) {
+		output_default(hits[i].str, hits[i].len, is_odd(count));
+		count++;
+	}
+
+	free(hits);
+
+	for (int i = 0; i < memo_opts.jobs; i++) {
+		if (scans[i].error != 0) {
+			regerror(scans[i].error, &scans[i].regex, buffer,
+				 sizeof(buffer));
+			fail(stderr, "%s: %s\n", __func__, buffer);
+			break;
+		}
+	}
+out:
+	for (int i = 0; i < compiled; i++) {
+		regfree(&scans[i].regex);
+		free(scans[i].line);
+	}
+
+	free(scans);
+
+	return ret == -1 ? -1 : count;
+}
+
+
+/* Search using regular expressions (POSIX Basic Regular Expression syntax)
+ * Returns the count of found notes or -1 if functions fails.
+ */
+static int search_regexp(const char *regexp)
+{
+	int count = 0;
+	regex_t regex;
+	int ret;
+	struct memo_map map;
+	struct line_view view;
+	size_t pos = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	char buffer[100];
+	struct offset_set candidates;
+
+	ret = regcomp(&regex, regexp, REG_ICASE);
+
+	if (ret != 0) {
+		fail(stderr, "%s: invalid regexp\n", __func__);
+		return -1;
+	}
+
+	if (memo_map_open(&map) == -1) {
+		regfree(&regex);
+		return -1;
+	}
+
+	/* Ignore empty note file and exit */
+	if (map.size == 0) {
+		regfree(&regex);
+		memo_map_close(&map);
+		return -1;
+	}
+
+	/* With the trigram index only the candidate notes and the notes
+	 * appended after the index was built need to be checked.
+	 */
+	if (search_index_enabled() &&
+	    trigram_index_search(&map, regexp, &candidates, &pos) == 0) {
+		for (size_t i = 0; i < candidates.count && !output_is_done();
+		     i++) {
+			if (candidates.offsets[i] >= pos ||
+			    memo_map_line_at(&map, candidates.offsets[i],
+					     &view) == -1)
+				continue;
+
+			if (line_view_to_string(&view, &line, &line_size) == NULL)
+				break;
+
+			ret = regexec(&regex, line, 0, NULL, 0);
+
+			if (ret == 0) {
+				output_default(view.str, view.len, is_odd(count));
+				count++;
+			} else if (ret != REG_NOMATCH) {
+				regerror(ret, &regex, buffer, sizeof(buffer));
+				fail(stderr, "%s: %s\n", __func__, buffer);
+				break;
+			}
+		}
+
+		free(candidates.offsets);
+	}
+
+	if (memo_opts.jobs > 1) {
+		count = search_regexp_parallel(&map, pos, regexp, count);
+		pos = map.size;
+	}
+
+	while (!output_is_done() && memo_map_next_line(&map, &pos, &view)) {
+		if (line_view_to_string(&view, &line, &line_size) == NULL)
+			break;
+
+		ret = regexec(&regex, line, 0, NULL, 0);
+
+		if (ret == 0) {
+			output_default(view.str, view.len, is_odd(count));
+			count++;
+		} else if (ret != 0 && ret != REG_NOMATCH) {
+			/* Something went wrong while executing
+			   regexp. Clean up and exit loop. */
+			regerror(ret, &regex, buffer, sizeof(buffer));
+			fail(stderr, "%s: %s\n", __func__, buffer);
+
+			break;
+		}
+	}
+
+	free(line);
+	regfree(&regex);
+	memo_map_close(&map);
+
+	return count;
+}
+
+
+/* Read the next term of the query string from *p to key, op and value.
+ * Values in double quotes may contain spaces, \" and \\ are unescaped.
+ * value must have room for strlen(*p) + 1 bytes. *p is moved after the
+ * term.
+ *
+ * Returns 1 when a term was read, 0 at the end of the query and -1 if
+ * the term is not valid.
+ */
+static int query_next_term(const char **p, char *key, size_t key_size,
+			   char *op, char *value, size_t *value_len)
+{
+	const char *s = *p;
+	size_t n = 0;
+
+	while (*s == ' ' || *s == '\t')
+		s++;
+
+	if (*s == '\0')
+		return 0;
+
+	while (isalpha((unsigned char)*s) && n + 1 < key_size)
+		key[n++] = tolower((unsigned char)*s++);
+
+	key[n] = '\0';
+	n = 0;
+
+	while (*s && strchr(":~<>=!", *s) && n < 2)
+		op[n++] = *s++;
+
+	op[n] = '\0';
+	n = 0;
+
+	if (*s == '"') {
+		s++;
+
+		while (*s && *s != '"') {
+			if (*s == '\\' && (s[1] == '"' || s[1] == '\\'))
+				s++;
+
+			value[n++] = *s++;
+		}
+
+		if (*s != '"')
+			return -1;
+
+		s++;
+	} else {
+		while (*s && *s != ' ' && *s != '\t')
+			value[n++] = *s++;
+	}
+
+	value[n] = '\0';
+	*value_len = n;
+	*p = s;
+
+	return key[0] && op[0] ? 1 : -1;
+}
+
+
+/* Narrow the inclusive range [*min, *max] with the comparison op and
+ * value. Returns 0 on success, -1 if op is not a comparison.
+ */
+static int query_narrow_range(const char *op, uint32_t value, uint32_t *min,
+			      uint32_t *max)
+{
+	uint32_t lo = 0;
+	uint32_t hi = UINT32_MAX;
+
+	if (strcmp(op, "=") == 0 || strcmp(op, ":") == 0) {
+		lo = hi = value;
+	} else if (strcmp(op, "<") == 0) {
+		/* Nothing is below 0, leave the range empty */
+		if (value == 0) {
+			lo = 1;
+			hi = 0;
+		} else {
+			hi = value - 1;
+		}
+	} else if (strcmp(op, "<=") == 0) {
+		hi = value;
+	} else if (strcmp(op, ">") == 0) {
+		if (value == UINT32_MAX) {
+			lo = 1;
+			hi = 0;
+		} else {
+			lo = value + 1;
+		}
+	} else if (strcmp(op, ">=") == 0) {
+		lo = value;
+	} else {
+		return -1;
+	}
+
+	/* An empty range is left with min above max */
+	if (lo > *min)
+		*min = lo;
+
+	if (hi < *max)
+		*max = hi;
+
+	return 0;
+}
+
+
+/* Get the predicate of given type from the plan, adding one if the
+ * plan doesn't have it yet. Text predicates are always added.
+ */
+static struct query_pred *query_pred_get(struct query *q, QueryPred_t type)
+{
+	struct query_pred *pred;
+
+	for (size_t i = 0; i < q->count && type != QUERY_TEXT; i++) {
+		if (q->preds[i].type == type)
+			return &q->preds[i];
+	}
+
+	pred = &q->preds[q->count++];
+	memset(pred, 0, sizeof(*pred));
+	pred->type = type;
+	pred->mask = UINT32_MAX;
+	pred->max = UINT32_MAX;
+
+	return pred;
+}
+
+
+/* Comparator for qsort, puts the cheapest predicates first */
+static int query_pred_sort(const void *a, const void *b)
+{
+	const struct query_pred *x = a;
+	const struct query_pred *y = b;
+
+	return (x->type > y->type) - (x->type < y->type);
+}
+
+
+/* Compile the query string to a plan of predicates. Terms of the query
+ * are separated by spaces and all of them must match:
+ *
+ *   status:UDP               status is any of the listed ones
+ *   id<op>n                  id compares to n
+ *   date<op>yyyy-MM-dd       date compares to the given date
+ *   text~word, text~"words"  content contains the text, ignoring case
+ *
+ * where <op> is one of = < <= > >=. The plan checks the status byte
+ * first, then the id and the packed date and the content last.
+ *
+ * Returns 0 on success, -1 on failure. Caller must call query_free
+ * after calling the function successfully.
+ */
+static int query_compile(struct query *q, const char *str)
+{
+	size_t len = strlen(str);
+	char *value = malloc(len + 1);
+	const char *p = str;
+	const char *term = str;
+	char key[16];
+	char op[3];
+	size_t value_len;
+	size_t folded_used = 0;
+	int ret;
+
+	memset(q, 0, sizeof(*q));
+
+	/* Every term is at least two bytes long, plus the merged
+	 * status, id and date predicates.
+	 */
+	q->preds = malloc((len / 2 + 4) * sizeof(*q->preds));
+	q->folded = malloc(len + 1);
+
+	if (value == NULL || q->preds == NULL || q->folded == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		goto error;
+	}
+
+	for (;;) {
+		struct query_pred *pred;
+
+		term = p;
+		ret = query_next_term(&p, key, sizeof(key), op, value,
+				      &value_len);
+
+		if (ret != 1)
+			break;
+
+		if (strcmp(key, "status") == 0 &&
+		    (strcmp(op, ":") == 0 || strcmp(op, "=") == 0)) {
+			uint32_t mask = 0;
+
+			for (size_t i = 0; i < value_len; i++) {
+				switch (toupper((unsigned char)value[i])) {
+				case 'U':
+					mask |= 1u << UNDONE;
+					break;
+				case 'D':
+					mask |= 1u << DONE;
+					break;
+				case 'P':
+					mask |= 1u << POSTPONED;
+					break;
+				default:
+					fail(stderr, "%s: invalid status %s\n",
+						__func__, value);
+					goto error;
+				}
+			}
+
+			if (value_len == 0)
+				goto invalid;
+
+			/* Several status terms must all match */
+			pred = query_pred_get(q, QUERY_STATUS);
+			pred->mask &= mask;
+		} else if (strcmp(key, "date") == 0) {
+			if (is_valid_date_format(value, 0) == -1)
+				goto error;
+
+			pred = query_pred_get(q, QUERY_DATE);
+
+			if (query_narrow_range(op, pack_date(value, value_len),
+					       &pred->min, &pred->max) == -1)
+				goto invalid;
+		} else if (strcmp(key, "id") == 0) {
+			char *end = NULL;
+			unsigned long id = strtoul(value, &end, 10);
+
+			if (value_len == 0 || *end != '\0' || id > UINT32_MAX)
+				goto invalid;
+
+			pred = query_pred_get(q, QUERY_ID);
+
+			if (query_narrow_range(op, id, &pred->min,
+					       &pred->max) == -1)
+				goto invalid;
+		} else if (strcmp(key, "text") == 0 && strcmp(op, "~") == 0) {
+			pred = query_pred_get(q, QUERY_TEXT);
+			search_term_compile(&pred->term, value, value_len,
+					    q->folded + folded_used);
+			folded_used += value_len;
+		} else {
+			goto invalid;
+		}
+	}
+
+	if (ret == -1)
+		goto invalid;
+
+	qsort(q->preds, q->count, sizeof(*q->preds), query_pred_sort);
+	free(value);
+
+	return 0;
+
+invalid:
+	fail(stderr, "%s: invalid query term: %s\n", __func__, term);
+error:
+	free(value);
+	query_free(q);
+
+	return -1;
+}
+
+
+static void query_free(struct query *q)
+{
+	free(q->preds);
+	free(q->folded);
+	memset(q, 0, sizeof(*q));
+}
+
+
+/* Check the note against the plan of the query. The status is checked
+ * from the raw line before the note is parsed at all.
+ *
+ * Returns 1 if the note matches, 0 otherwise.
+ */
+static int query_match(const struct query *q, const struct line_view *line)
+{
+	struct note_view note;
+	size_t i = 0;
+
+	if (q->count > 0 && q->preds[0].type == QUERY_STATUS) {
+		const char *tab = scan_byte(line->str, line->len, '\t');
+		uint32_t mask = q->preds[0].mask;
+		int status;
+
+		if (tab == NULL || tab + 1 >= line->str + line->len)
+			return 0;
+
+		switch (tab[1]) {
+		case 'U':
+			status = UNDONE;
+			break;
+		case 'D':
+			status = DONE;
+			break;
+		case 'P':
+			status = POSTPONED;
+			break;
+		default:
+			return 0;
+		}
+
+		if (!(mask & (1u << status)))
+			return 0;
+
+		i++;
+	}
+
+	if (parse_note(line->str, line->len, &note) == -1)
+		return 0;
+
+	for (; i < q->count; i++) {
+		const struct query_pred *pred = &q->preds[i];
+
+		switch (pred->type) {
+		case QUERY_STATUS:
+			if (!(pred->mask & (1u << note.status)))
+				return 0;
+			break;
+		case QUERY_ID:
+			if (note.id < 0 || (uint32_t)note.id < pred->min ||
+			    (uint32_t)note.id > pred->max)
+				return 0;
+			break;
+		case QUERY_DATE:
+			if (note.packed_date == 0 ||
+			    note.packed_date < pred->min ||
+			    note.packed_date > pred->max)
+				return 0;
+			break;
+		case QUERY_TEXT:
+			if (search_term_find(&pred->term, note.content.str,
+					     note.content.len) == NULL)
+				return 0;
+			break;
+		}
+	}
+
+	return 1;
+}
 
 
-/* Function displays notes ordered by date.
+static int query_scan_match(void *ctx, const struct line_view *note)
+{
+	return query_match(ctx, note);
+}
+
+
+/* Show the notes matching the query, see query_compile.
  *
- * For example:
+ * Returns the count of found notes or -1 if function fails.
+ */
+static int query_notes(const char *str)
+{
+	struct query q;
+	struct memo_map map;
+	struct line_view line;
+	struct line_view *hits = NULL;
+	size_t hit_count = 0;
+	size_t pos = 0;
+	int count = 0;
+
+	if (query_compile(&q, str) == -1)
+		return -1;
+
+	if (memo_map_open(&map) == -1) {
+		query_free(&q);
+		return -1;
+	}
+
+	/* The plan is not changed while matching, so the threads can
+	 * share it.
+	 */
+	if (memo_opts.jobs > 1) {
+		if (parallel_scan(&map, 0, memo_opts.jobs, query_scan_match,
+				  &q, 0, &hits, &hit_count) == -1)
+			count = -1;
+
+		pos = map.size;
+	}
+
+	for (size_t i = 0; i < hit_count; i++) {
+		output(hits[i].str, hits[i].len, is_odd(count));
+		count++;
+	}
+
+	while (!output_is_done() && memo_map_next_line(&map, &pos, &line)) {
+		if (query_match(&q, &line)) {
+			output(line.str, line.len, is_odd(count));
+			count++;
+		}
+	}
+
+	free(hits);
+	memo_map_close(&map);
+	query_free(&q);
+
+	return count;
+}
+
+
+/* Replace note status old with new status in line. Only the status
+ * field is changed and only if it has the status old. Empty lines are
+ * left as they are.
+ */
+static void note_status_replace(char *line, char old, char new)
+{
+	struct note_view note;
+
+	if (line[0] == '\0')
+		return;
+
+	if (parse_note(line, strlen(line), &note) == -1) {
+		report_malformed_note(__func__, line, strlen(line));
+		return;
+	}
+
+	if (note.status_str.str[0] == old)
+		line[note.status_str.str - line] = new;
+}
+
+
+/* Split a note line of len bytes to its fields in one pass:
  *
- *   2014-11-01
- *         1   U   Release Memo 1.3
- *         2   D   Pay rent
- *   2014-11-02
- *         3   D   Go shopping
+ * id <tab> status <tab> date <tab> content
  *
- * Returns the count of the notes. On failure returns -1.
+ * Content is the rest of the line and may contain tabs. The line is
+ * not modified and nothing is allocated, fields of note point into the
+ * line.
+ *
+ * Returns 0 on success, -1 if the line is not a valid note.
  */
-static int show_notes_tree()
+static int parse_note(const char *line, size_t len, struct note_view *note)
+{
+	struct line_view *fields[3] = { &note->id_str, &note->status_str,
+					&note->date };
+	const char *end = line + len;
+	const char *p = line;
+
+	note->line.str = line;
+	note->line.len = len;
+
+	for (int i = 0; i < 3; i++) {
+		const char *tab = scan_byte(p, end - p, '\t');
+
+		/* Empty fields are not allowed */
+		if (tab == NULL || tab == p)
+			return -1;
+
+		fields[i]->str = p;
+		fields[i]->len = tab - p;
+		p = tab + 1;
+	}
+
+	note->content.str = p;
+	note->content.len = end - p;
+
+	note->id = get_note_id_from_view(note->id_str.str, note->id_str.len);
+
+	for (size_t i = 0; i < note->id_str.len; i++) {
+		if (!isdigit((unsigned char)note->id_str.str[i]))
+			return -1;
+	}
+
+	/* 0 when the date is not a yyyy-MM-dd date */
+	note->packed_date = pack_date(note->date.str, note->date.len);
+
+	if (note->status_str.len != 1)
+		return -1;
+
+	switch (note->status_str.str[0]) {
+	case 'U':
+		note->status = UNDONE;
+		break;
+	case 'D':
+		note->status = DONE;
+		break;
+	case 'P':
+		note->status = POSTPONED;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Report a line which parse_note could not make sense of. Only the
+ * beginning of the line is shown.
+ */
+static void report_malformed_note(const char *func, const char *line,
+				  size_t len)
+{
+	/* Keep the report after the notes shown before it */
+	output_flush();
+
+	fail(stderr, "%s: malformed note: %.*s%s\n", func,
+		(int)(len > 40 ? 40 : len), line, len > 40 ? "..." : "");
+}
+
+
+/* Get the status character of the note line, 0 if the line is not a
+ * valid note.
+ */
+static char get_note_status_char(const char *line, size_t len)
+{
+	struct note_view note;
+
+	if (parse_note(line, len, &note) == -1)
+		return 0;
+
+	return note.status_str.str[0];
+}
+
+
+/* Get the note status from the note line. line does not need to be
+ * NUL terminated, len is the length of the line.
+ *
+ * Returns STATUS_ERROR on failure.
+ */
+static NoteStatus_t get_note_status(const char *line, size_t len)
+{
+	struct note_view note;
+
+	/* Sanity check for an empty line */
+	if (len == 0)
+		return STATUS_ERROR;
+
+	if (parse_note(line, len, &note) == -1) {
+		report_malformed_note(__func__, line, len);
+		return STATUS_ERROR;
+	}
+
+	return note.status;
+}
+
+
+/* Simple helper function to mark note as done */
+static void mark_as_done(char *line)
+{
+	if (get_note_status(line, strlen(line)) == POSTPONED)
+		note_status_replace(line, 'P', 'D');
+	else
+		note_status_replace(line, 'U', 'D');
+}
+
+
+/* Simple helper function to mark note as undone */
+static void mark_as_undone(char *line)
+{
+	if (get_note_status(line, strlen(line)) == POSTPONED)
+		note_status_replace(line, 'P', 'U');
+	else
+		note_status_replace(line, 'D', 'U');
+}
+
+
+/* Simple helper function to mark note as postponed */
+static void mark_as_postponed(char *line)
+{
+	/* Only UNDONE notes can be postponed */
+	if (get_note_status(line, strlen(line)) == UNDONE)
+		note_status_replace(line, 'U', 'P');
+}
+
+
+/* Mark note by status U is undone, D is done or P postponed. When
+ * status is DELETE, the note with a matching id will be deleted.
+ *
+ * A single note is looked up using the note index, and only that note
+ * is replaced in the memo file. With DELETE_DONE and ALL_DONE
+ * function will create a temporary file to write the memo file with
+ * new changes. Then the original file is replaced with the temp file.
+ *
+ * id is ignored when status is DELETE_DONE or ALL_DONE.
+ */
+static int mark_note_status(NoteStatus_t status, int id)
 {
-	int count = 0;
-	int lines = 0;
 	FILE *fp = NULL;
-	int date_index = 0;
+	FILE *tmpfp = NULL;
+	char *line = NULL;
+	char *tmp;
+	int lines = 0;
+	struct stat st;
+
+	tmp = get_memo_file_path();
+
+	if (tmp == NULL)
+		return -1;
+
+	/* Ignore empty note file and exit */
+	if (stat(tmp, &st) == 0 && st.st_size == 0) {
+		printf("Nothing to do. No notes found\n");
+		free(tmp);
+		return -1;
+	}
+
+	free(tmp);
+
+	if (status == DONE || status == UNDONE || status == POSTPONED ||
+	    status == DELETE) {
+		off_t offset;
+		size_t len;
+		int ret;
+
+		line = get_note_by_id(id, &offset, &len);
+
+		if (line == NULL)
+			return -1;
+
+		if (status == DELETE) {
+			ret = splice_memo_file(offset, len, NULL);
+			free(line);
+			return ret;
+		}
+
+		/* Status is a single character, so the note is changed in
+		 * place instead of rewriting the memo file.
+		 */
+		struct status_change change;
+		struct note_view note;
+
+		if (parse_note(line, len, &note) == -1) {
+			report_malformed_note(__func__, line, len);
+			free(line);
+			return -1;
+		}
+
+		char *field = line + (note.status_str.str - line);
+
+		memset(&change, 0, sizeof(change));
+		change.offset = offset + (field - line);
+		change.old = *field;
+
+		switch (status) {
+		case DONE:
+			mark_as_done(line);
+			break;
+		case UNDONE:
+			mark_as_undone(line);
+			break;
+		case POSTPONED:
+			mark_as_postponed(line);
+			break;
+		default:
+			break;
+		}
+
+		change.new = *field;
+		free(line);
+
+		if (change.new == change.old)
+			return 0;
+
+		return write_status_changes(&change, 1);
+	}
 
 	fp = get_memo_file_ptr("r");
 	lines = count_file_lines(fp);
 
 	if (lines == -1) {
-		fail(stderr, "%s: counting lines failed\n", __func__);
+		fail(stderr,"%s: counting lines failed\n", __func__);
 		return -1;
 	}
 
 	/* Ignore empty note file and exit */
 	if (lines == -2) {
 		fclose(fp);
+		printf("Nothing to do. No notes found\n");
 		return -1;
 	}
 
-	int n = lines;
-	char *dates[lines + 1];
+	tmp = get_temp_memo_path();
 
-	memset(dates, 0, sizeof(dates));
+	if (tmp == NULL) {
+		fail(stderr,"%s: error getting a temp file\n",
+			__func__);
+		return -1;
+	}
 
-	/* Get the date of each note and store the pointer
-	 * of it to dates array
-	 */
-	while (n >= 0) {
-		char *line = read_file_line(fp);
-		if (line) {
-			char *date = get_note_date(line);
-			int has_date = 0;
+	char *memofile = get_memo_file_path();
 
-			if (date == NULL) {
-				free(line);
-				fclose(fp);
-				fail(stderr, "%s problem getting date\n",
-					__func__);
-				return -1;
-			}
-			/* Prevent storing duplicate dates*/
-			for (int i = 0; i < date_index; i++) {
-				if (dates[i]) {
-					if (strcmp(dates[i], date) == 0) {
-						has_date = 1;
-						break;
-					}
-				}
-			}
+	if (memofile == NULL) {
+		fail(stderr,"%s: failed to get ~/.memo file path\n",
+			__func__);
+		return -1;
+	}
 
-			/* If dates does not contain date, store it
-			 * otherwise free it
-			 */
-			if (!has_date) {
-				dates[date_index] = date;
-				date_index++;
-			} else {
-				free(date);
-			}
+	tmpfp = fopen(tmp, "w");
 
-			count++;
-			free(line);
-		}
-		n--;
+	if (tmpfp == NULL) {
+		fail(stderr,"%s: error opening %s\n", __func__, tmp);
+		free(memofile);
+		return -1;
 	}
 
-	/* Sort the dates elements in the order of date. */
-	sort_dates_ascend(dates, date_index);
 
-	/* Loop through all dates and print all notes for
-	 * the date.
-	 */
-	for (int i = 0; i <= lines; i++) {
-		/* Rewind file pointer to beginning every time to
-		 * loop all the notes in the file.
-		 * It's possible that the array is not fully populated (because
-		 * it's allocated to have as many elements as we have notes,
-		 * however duplicate dates are not stored at all.
-		 * so do a check if the value is null.
-		 */
-		if (dates[i]) {
-			n = lines;
-			rewind(fp);
-			printf("%s\n", dates[i]);
-			while (n >= 0) {
-				char *line = read_file_line(fp);
-				if (line) {
-					char *date = get_note_date(line);
-					if (date == NULL) {
-						free(line);
-						fclose(fp);
-						return -1;
-					}
+	while (lines >= 0) {
+		line = read_file_line(fp);
 
-					if (strcmp(date, dates[i]) == 0)
-						output_without_date(line, is_odd(i));
+		if (line) {
 
-					free(line);
-					free(date);
-				}
-				n--;
+			switch(status) {
+
+			case DELETE_DONE:
+				if (get_note_status(line, strlen(line)) != DONE)
+					fprintf(tmpfp, "%s\n", line);
+				break;
+			case ALL_DONE:
+				note_status_replace(line, 'U', 'D');
+				fprintf(tmpfp, "%s\n", line);
+				break;
+			default:
+				fail(stderr,"STATUS_ERROR, this shouldn't happen\n");
+				break;
 			}
-			free(dates[i]);
+
+			free(line);
 		}
+
+		lines--;
 	}
 
 	fclose(fp);
+	fclose(tmpfp);
 
-	return count;
+	if (file_exists(memofile))
+		remove(memofile);
+
+	rename(tmp, memofile);
+	remove(tmp);
+
+	memo_index_invalidate();
+	search_index_invalidate();
+
+	free(memofile);
+	free(tmp);
+
+	return 0;
 }
 
 
-/* Function works like strstr, but ignores the case.
- * There's a function strcasestr, but it's nonstandard
- * GNU extension, so let's not use that.
+/* Write the new status characters of changes straight to the memo file
+ * with pwrite.
+ *
+ * To survive a crash, the changes are first written to .memo.jnl
+ * journal file and flushed to disk. The journal is removed once the
+ * memo file itself is flushed. If Memo finds the journal when starting,
+ * the unfinished changes are rolled back, see recover_status_journal.
  *
- * Return value must be freed by the caller.
+ * The note index stays valid as no note moves.
+ *
+ * Returns 0 on success, -1 on failure.
  */
-static char *case_strstr(const char *str1, const char *str2)
+static int write_status_changes(const struct status_change *changes,
+				size_t count)
 {
-	char *tmp1 = NULL;
-	char *tmp2 = NULL;
-	char *tmp3 = NULL;
-	char *retval = NULL;
+	struct memo_journal_header header;
+	struct stat old;
+	struct stat new;
+	char *memofile = NULL;
+	char *journal = NULL;
+	int fd = -1;
+	int jfd = -1;
+	size_t done = 0;
 
-	tmp1 = strdup(str1);
+	memofile = get_memo_file_path();
+	journal = get_memo_sidecar_path(".jnl");
 
-	if (tmp1 == NULL) {
-		fail(stderr, "%s: strdup failed\n", __func__);
-		return NULL;
-	}
+	if (memofile == NULL || journal == NULL)
+		goto error;
 
-	tmp2 = strdup(str2);
+	fd = open(memofile, O_RDWR);
 
-	if (tmp2 == NULL) {
-		free(tmp1);
-		fail(stderr, "%s: strdup failed\n", __func__);
-		return NULL;
+	if (fd == -1 || fstat(fd, &old) == -1) {
+		fail(stderr, "%s: error opening %s\n", __func__, memofile);
+		goto error;
 	}
 
-	for (int i = 0; i < strlen(tmp1); i++)
-		tmp1[i] = tolower(tmp1[i]);
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MEMO_JOURNAL_MAGIC, 4);
+	header.count = count;
+	header.memo_size = old.st_size;
+	header.checksum = status_changes_checksum(changes, count);
 
-	for (int i = 0; i < strlen(tmp2); i++)
-		tmp2[i] = tolower(tmp2[i]);
+	jfd = open(journal, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
 
-	tmp3 = strstr(tmp1, tmp2);
+	if (jfd == -1 ||
+	    write(jfd, &header, sizeof(header)) != sizeof(header) ||
+	    write(jfd, changes, count * sizeof(*changes)) !=
+	    (ssize_t)(count * sizeof(*changes)) ||
+	    memo_fsync(jfd) == -1) {
+		fail(stderr, "%s: error writing %s\n", __func__, journal);
+		goto error;
+	}
 
-	if (tmp3) {
-		retval = strdup(tmp3);
-		/* Sanity check
-		 * Inform the user that something went wrong
-		 * even the search term was found. Probably never happens.
-		 */
-		if (retval == NULL) {
-			fail(stderr,"%s: search term found, but strdup fails\n",
-				__func__);
+	close(jfd);
+	jfd = -1;
+	fsync_parent_dir(journal);
+
+	for (done = 0; done < count; done++) {
+		if (memo_pwrite(fd, &changes[done].new, 1,
+				changes[done].offset) != 1) {
+			fail(stderr, "%s: error writing %s\n", __func__,
+				memofile);
+			goto rollback;
 		}
 	}
 
-	free(tmp1);
-	free(tmp2);
-
-	return retval;
-}
+	if (memo_fsync(fd) == -1) {
+		fail(stderr, "%s: error writing %s\n", __func__, memofile);
+		goto rollback;
+	}
 
+	/* The change is committed once the removal of the journal is on
+	 * disk, otherwise the journal could come back after a crash.
+	 */
+	remove(journal);
+	fsync_parent_dir(journal);
+	search_index_invalidate();
 
-/* Search if a note contains the search term.
- * Returns the count of found notes or -1 if function fails.
- */
-static int search_notes(char *search)
-{
-	FILE *fp = NULL;
-	int count = 0;
-	char *line;
-	int lines = 0;
+	if (fstat(fd, &new) == 0) {
+		int all_done = 1;
 
-	fp = get_memo_file_ptr("r");
+		memo_index_restamp(&old, &new, changes, count);
 
-	lines = count_file_lines(fp);
+		for (size_t i = 0; i < count; i++) {
+			if (changes[i].new != 'D')
+				all_done = 0;
+		}
 
-	if (lines == -1) {
-		fail(stderr,"%s: counting lines failed\n", __func__);
-		return -1;
+		/* Notes marked done can't make the watermark invalid */
+		if (all_done)
+			aging_mark_restamp(&old, &new, NULL, 0);
+		else
+			aging_mark_invalidate();
 	}
 
-	/* Ignore empty note file and exit */
-	if (lines == -2) {
-		fclose(fp);
-		return -1;
-	}
+	close(fd);
+	free(memofile);
+	free(journal);
 
-	while (lines >= 0) {
-		line = read_file_line(fp);
+	return 0;
 
-		if (line) {
-			char *token = NULL;
-			token = strtok(search, " ");
-			/* Loop through each word in the search string
-			 * and see if any of the words can be found
-			 */
-			while (token != NULL) {
-				char *foundptr = case_strstr(line, token);
-
-				if (foundptr){
-					output_default(line, is_odd(count));
-					count++;
-					free(foundptr);
-					/* found it, no point to continue */
-					break;
-				}
+rollback:
+	while (done-- > 0)
+		memo_pwrite(fd, &changes[done].old, 1, changes[done].offset);
 
-				token = strtok(NULL, " ");
-			}
+	memo_fsync(fd);
+error:
+	if (jfd != -1)
+		close(jfd);
 
-			free(line);
-		}
+	if (journal)
+		remove(journal);
 
-		lines--;
-	}
+	if (fd != -1)
+		close(fd);
 
-	fclose(fp);
+	free(memofile);
+	free(journal);
 
-	return count;
+	return -1;
 }
 
 
-/* Search using regular expressions (POSIX Basic Regular Expression syntax)
- * Returns the count of found notes or -1 if functions fails.
+/* Roll back status changes left unfinished by write_status_changes,
+ * for example because Memo was killed or the machine crashed in the
+ * middle of writing them.
+ *
+ * A journal which is incomplete or does not match the memo file is
+ * discarded without touching the memo file. So is a journal whose
+ * changes are all found in the memo file already, the change was
+ * completed and only the removal of the journal was lost.
  */
-static int search_regexp(const char *regexp)
+static void recover_status_journal()
 {
-	int count = 0;
-	regex_t regex;
-	int ret;
-	char *line = NULL;
-	char lines = 0;
-	FILE *fp = NULL;
-	char buffer[100];
+	struct memo_journal_header header;
+	struct status_change *changes = NULL;
+	struct stat st;
+	char *memofile = NULL;
+	char *journal = NULL;
+	int fd = -1;
+	int jfd = -1;
+	int committed = 1;
+	size_t i;
 
-	ret = regcomp(&regex, regexp, REG_ICASE);
+	journal = get_memo_sidecar_path(".jnl");
 
-	if (ret != 0) {
-		fail(stderr, "%s: invalid regexp\n", __func__);
-		return -1;
-	}
+	if (journal == NULL)
+		return;
 
-	fp = get_memo_file_ptr("r");
-	lines = count_file_lines(fp);
+	jfd = open(journal, O_RDONLY);
 
-	if (lines == -1) {
-		regfree(&regex);
-		fail(stderr,"%s: counting lines failed\n", __func__);
-		return -1;
+	if (jfd == -1) {
+		free(journal);
+		return;
 	}
 
-	/* Ignore empty note file and exit */
-	if (lines == -2) {
-		regfree(&regex);
-		return -1;
-	}
+	if (read(jfd, &header, sizeof(header)) != sizeof(header) ||
+	    memcmp(header.magic, MEMO_JOURNAL_MAGIC, 4) != 0 ||
+	    fstat(jfd, &st) == -1)
+		goto out;
 
-	while (lines >= 0) {
-		line = read_file_line(fp);
+	/* Don't trust the count before checking the journal has room
+	 * for the entries.
+	 */
+	if (header.count > (st.st_size - sizeof(header)) / sizeof(*changes))
+		goto out;
 
-		if (line) {
-			ret = regexec(&regex, line, 0, NULL, 0);
+	changes = malloc(header.count * sizeof(*changes) + 1);
 
-			if (ret == 0) {
-				output_default(line, is_odd(count));
-				count++;
-			} else if (ret != 0 && ret != REG_NOMATCH) {
-				/* Something went wrong while executing
-				   regexp. Clean up and exit loop. */
-				regerror(ret, &regex, buffer, sizeof(buffer));
-				fail(stderr, "%s: %s\n", __func__, buffer);
-				free(line);
+	if (changes == NULL ||
+	    read(jfd, changes, header.count * sizeof(*changes)) !=
+	    (ssize_t)(header.count * sizeof(*changes)) ||
+	    status_changes_checksum(changes, header.count) != header.checksum)
+		goto out;
 
-				break;
-			}
+	memofile = get_memo_file_path();
 
-			free(line);
-		}
+	if (memofile == NULL)
+		goto out;
 
-		lines--;
+	fd = open(memofile, O_RDWR);
+
+	if (fd == -1 || fstat(fd, &st) == -1 ||
+	    (uint64_t)st.st_size != header.memo_size)
+		goto out;
+
+	/* Check everything before writing anything */
+	for (i = 0; i < header.count; i++) {
+		char ch;
+
+		if (memo_pread(fd, &ch, 1, changes[i].offset) != 1 ||
+		    (ch != changes[i].old && ch != changes[i].new))
+			goto out;
+
+		if (ch != changes[i].new)
+			committed = 0;
 	}
 
-	regfree(&regex);
-	fclose(fp);
+	if (committed)
+		goto out;
 
-	return count;
+	for (i = 0; i < header.count; i++)
+		memo_pwrite(fd, &changes[i].old, 1, changes[i].offset);
+
+	memo_fsync(fd);
+	fail(stderr, "Rolled back %u unfinished status changes\n",
+		header.count);
+
+out:
+	if (fd != -1)
+		close(fd);
+
+	close(jfd);
+	remove(journal);
+	fsync_parent_dir(journal);
+
+	free(changes);
+	free(memofile);
+	free(journal);
 }
 
 
-/* Replace note status old with new status in line.*/
-static void note_status_replace(char *line, char old, char new)
+/* Checksum of the journal entries to detect a partially written
+ * journal. FNV-1a over the entries.
+ */
+static uint32_t status_changes_checksum(const struct status_change *changes,
+					size_t count)
 {
-	while (*line) {
-		if (*line == old) {
-			*line = new;
-			break;
-		}
-		line++;
+	const unsigned char *p = (const unsigned char *)changes;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < count * sizeof(*changes); i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
 	}
+
+	return hash;
 }
 
 
-/* Get the note status from the note line.
- * Returns STATUS_ERROR on failure.
+/* Rewrite the memo file replacing len bytes at offset with line. The
+ * new line character following the replaced note is kept. When line
+ * is NULL, the note is removed together with its new line character.
+ *
+ * Rest of the file is copied as is, so lines do not need to be parsed.
+ * Like elsewhere the new content is written to a temporary file which
+ * then replaces the memo file.
+ *
+ * Returns 0 on success, -1 on failure.
  */
-static NoteStatus_t get_note_status(const char *line)
+static int splice_memo_file(off_t offset, size_t len, const char *line)
 {
-	char *token = NULL;
-	char *buffer = NULL;
-	NoteStatus_t status;
+	struct memo_map map;
+	FILE *tmpfp = NULL;
+	char *memofile = NULL;
+	char *tmpfile = NULL;
+	struct stat old;
+	struct stat new;
+	size_t end = offset + len;
+	int err = 0;
 
-	status = STATUS_ERROR;
+	if (memo_map_open(&map) == -1)
+		return -1;
 
-	/* Sanity check for an empty line */
-	if(strlen(line) == 0)
-		return status;
+	if (end > map.size) {
+		fail(stderr, "%s: note is outside of the memo file\n",
+			__func__);
+		memo_map_close(&map);
+		return -1;
+	}
 
-	buffer = malloc((strlen(line) + 1) * sizeof(char));
+	tmpfp = get_memo_tmpfile_ptr();
 
-	if (buffer == NULL) {
-		fail(stderr, "%s malloc failed\n", __func__);
-		return status;
+	if (tmpfp == NULL) {
+		memo_map_close(&map);
+		return -1;
 	}
 
-	strcpy(buffer, line);
+	fwrite(map.data, 1, offset, tmpfp);
 
-	token = strtok(buffer, "\t");
-	token = strtok(NULL, "\t");
+	if (line != NULL)
+		fputs(line, tmpfp);
+	else if (end < map.size && map.data[end] == '\n')
+		end++;
 
-	if (token == NULL) {
-		fail(stderr, "%s: parsing line failed\n", __func__);
-		free(buffer);
-		return status;
-	}
+	fwrite(map.data + end, 1, map.size - end, tmpfp);
 
-	if (strcmp(token, "U") == 0)
-		status = UNDONE;
-	else if (strcmp(token, "D") == 0)
-		status = DONE;
-	else if (strcmp(token, "P") == 0)
-		status = POSTPONED;
-
-	free(buffer);
+	old = map.st;
+	memo_map_close(&map);
 
-	return status;
-}
+	if (ferror(tmpfp))
+		err = 1;
 
+	if (fclose(tmpfp) != 0 || err) {
+		fail(stderr, "%s: error writing temp file\n", __func__);
+		return -1;
+	}
 
-/* Simple helper function to mark note as done */
-static void mark_as_done(FILE *fp, char *line)
-{
-	if (get_note_status(line) == POSTPONED)
-		note_status_replace(line, 'P', 'D');
-	else
-		note_status_replace(line, 'U', 'D');
+	memofile = get_memo_file_path();
+	tmpfile = get_temp_memo_path();
 
-	fprintf(fp, "%s\n", line);
-}
+	if (memofile == NULL || tmpfile == NULL) {
+		fail(stderr, "%s: failed to get memo file path\n", __func__);
+		free(memofile);
+		free(tmpfile);
+		return -1;
+	}
 
+	if (file_exists(memofile))
+		remove(memofile);
 
-/* Simple helper function to mark note as undone */
-static void mark_as_undone(FILE *fp, char *line)
-{
-	if (get_note_status(line) == POSTPONED)
-		note_status_replace(line, 'P', 'U');
-	else
-		note_status_replace(line, 'D', 'U');
+	rename(tmpfile, memofile);
+	remove(tmpfile);
 
-	fprintf(fp, "%s\n", line);
-}
+	/* Removing a note can't make the watermark invalid, but the
+	 * replaced note may have gotten an older date.
+	 */
+	search_index_invalidate();
 
+	if (stat(memofile, &new) == 0) {
+		memo_index_update(&old, &new, offset, len, line);
 
-/* Simple helper function to mark note as postponed */
-static void mark_as_postponed(FILE *fp, char *line)
-{
-	/* Only UNDONE notes can be postponed */
-	if (get_note_status(line) == UNDONE) {
-		note_status_replace(line, 'U', 'P');
-		fprintf(fp, "%s\n", line);
+		if (line == NULL)
+			aging_mark_restamp(&old, &new, NULL, 0);
+		else
+			aging_mark_invalidate();
 	} else {
-		fprintf(fp, "%s\n", line);
+		memo_index_invalidate();
+		aging_mark_invalidate();
 	}
-}
-
 
-/* Returns hte id of the short note. On failure, returns -1. */
-static int get_note_id_from_line(const char *line)
-{
-	int id = -1;
-
-	char *endptr;
-	id = strtol(line, &endptr, 10);
+	free(memofile);
+	free(tmpfile);
 
-	return id;
+	return 0;
 }
 
 
-/* Mark note by status U is undone, D is done or P postponed. When
- * status is DELETE, the note with a matching id will be deleted.
+/* Function reads ~/.memorc for MARK_AS_DONE property
+ * and marks all notes older than the property value as DONE.
  *
- * Function will create a temporary file to write the memo file with new
- * changes. Then the original file is replaced with the temp file.
-
- * id is ignored when status is DELETE_DONE or ALL_DONE.
+ * For example if you have MARK_AS_DONE=2014-12-13, this function
+ * will mark all notes older than 2014-12-13 as DONE.
+ *
+ * Notes are found with one pass over the memo file comparing packed
+ * dates, and all of them are marked at once. After that, the
+ * .memo.aging watermark records that the memo file has no such notes,
+ * so the pass is skipped until the file or the property changes.
+ *
+ * Returns count of marked notes on success, -1 on failure.
  */
-static int mark_note_status(NoteStatus_t status, int id)
+static int mark_old_as_done()
 {
-	FILE *fp = NULL;
-	FILE *tmpfp = NULL;
-	char *line = NULL;
-	char *tmp;
-	int lines = 0;
+	struct memo_map map;
+	struct line_view line;
+	struct status_change *changes = NULL;
+	size_t alloc = 0;
+	size_t count = 0;
+	size_t pos = 0;
+	uint32_t threshold;
+	const char *date = NULL;
+	struct stat st;
+
+	date = get_memo_conf_value(CONF_MARK_AS_DONE);
+
+	if (date == NULL)
+		return -1;
 
-	fp = get_memo_file_ptr("r");
-	lines = count_file_lines(fp);
+	if (is_valid_date_format(date, 0) == -1) {
 
-	if (lines == -1) {
-		fail(stderr,"%s: counting lines failed\n", __func__);
-		return -1;
-	}
+		fail(stderr, "%s: error in ~/.memorc parsing\n", __func__);
 
-	/* Ignore empty note file and exit */
-	if (lines == -2) {
-		fclose(fp);
-		printf("Nothing to do. No notes found\n");
 		return -1;
 	}
 
-	tmp = get_temp_memo_path();
+	threshold = pack_date(date, strlen(date));
 
-	if (tmp == NULL) {
-		fail(stderr,"%s: error getting a temp file\n",
-			__func__);
-		return -1;
-	}
+	char *path = get_memo_file_path();
 
-	char *memofile = get_memo_file_path();
+	if (path == NULL)
+		return -1;
 
-	if (memofile == NULL) {
-		fail(stderr,"%s: failed to get ~/.memo file path\n",
-			__func__);
+	if (stat(path, &st) == -1) {
+		free(path);
 		return -1;
 	}
 
-	tmpfp = fopen(tmp, "w");
+	free(path);
 
-	if (tmpfp == NULL) {
-		fail(stderr,"%s: error opening %s\n", __func__, tmp);
-		free(memofile);
+	if (aging_mark_is_fresh(threshold, &st))
+		return 0;
+
+	if (memo_map_open(&map) == -1)
 		return -1;
-	}
 
+	while (memo_map_next_line(&map, &pos, &line)) {
+		struct note_view note;
+		uint32_t note_date;
 
-	while (lines >= 0) {
-		line = read_file_line(fp);
+		if (parse_note(line.str, line.len, &note) == -1) {
+			report_malformed_note(__func__, line.str, line.len);
+			continue;
+		}
 
-		if (line) {
+		if (note.status == DONE)
+			continue;
 
-			int curr = get_note_id_from_line(line);
+		note_date = note.packed_date;
 
-			switch(status) {
+		/* Notes without a valid date are left alone */
+		if (note_date == 0 || note_date >= threshold)
+			continue;
 
-			case DONE:
-				if (curr == id)
-					mark_as_done(tmpfp, line);
-				else
-					fprintf(tmpfp, "%s\n", line);
-				break;
-			case UNDONE:
-				if (curr == id)
-					mark_as_undone(tmpfp, line);
-				else
-					fprintf(tmpfp, "%s\n", line);
-				break;
-			case DELETE:
-				/* Write all the other lines, except the one
-				 * with the matching id. This is a simple way
-				 * to delete the line from the file.
-				 */
-				if (curr != id)
-					fprintf(tmpfp, "%s\n", line);
-				break;
-			case DELETE_DONE:
-				if (get_note_status(line) != DONE)
-					fprintf(tmpfp, "%s\n", line);
-				break;
-			case STATUS_ERROR:
-				fail(stderr,"STATUS_ERROR, this shouldn't happen\n");
-				break;
-			case ALL_DONE:
-				note_status_replace(line, 'U', 'D');
-				fprintf(tmpfp, "%s\n", line);
-				break;
-			case POSTPONED:
-				if (curr == id)
-					mark_as_postponed(tmpfp, line);
-				else
-					fprintf(tmpfp, "%s\n", line);
-				break;
+		if (count == alloc) {
+			struct status_change *tmp;
+
+			alloc = alloc ? alloc * 2 : 64;
+			tmp = realloc(changes, alloc * sizeof(*changes));
+
+			if (tmp == NULL) {
+				fail(stderr, "%s: realloc failed\n", __func__);
+				free(changes);
+				memo_map_close(&map);
+				return -1;
 			}
 
-			free(line);
+			changes = tmp;
 		}
 
-		lines--;
+		memset(&changes[count], 0, sizeof(*changes));
+		changes[count].offset = note.status_str.str - map.data;
+		changes[count].old = note.status_str.str[0];
+		changes[count].new = 'D';
+		count++;
+	}
+
+	memo_map_close(&map);
+
+	if (count > 0 && write_status_changes(changes, count) == -1) {
+		free(changes);
+		return -1;
 	}
 
-	fclose(fp);
-	fclose(tmpfp);
+	free(changes);
 
-	if (file_exists(memofile))
-		remove(memofile);
+	/* write_status_changes moved the watermark if it was valid, but
+	 * on the first run, or after the file was changed, it's not.
+	 */
+	path = get_memo_file_path();
 
-	rename(tmp, memofile);
-	remove(tmp);
+	if (path && stat(path, &st) == 0)
+		aging_mark_save(threshold, &st);
 
-	free(memofile);
-	free(tmp);
+	free(path);
 
-	return 0;
+	return count;
 }
 
 
-/* Function reads ~/.memorc for MARK_AS_DONE property
- * and marks all notes older than the property value as DONE.
- *
- * For example if you have MARK_AS_DONE=2014-12-13, this function
- * will mark all notes older than 2014-12-13 as DONE.
+/* Read the .memo.aging watermark.
  *
- * Returns count of marked notes on success, -1 on failure.
+ * Returns 0 on success, -1 if the file is missing or broken.
  */
-static int mark_old_as_done()
+static int aging_mark_read(struct memo_aging_mark *mark)
 {
-#ifdef _WIN32
-	return -1;
-#endif
-	char *conf_path = NULL;
-	FILE *fp;
-	char *date = NULL;
-	struct tm dc = {0};
-	time_t date_to_compare;
-	int lines = 0;
+	char *path = get_memo_sidecar_path(".aging");
+	int ret = -1;
+	int fd;
 
-	conf_path = get_memo_conf_path();
+	if (path == NULL)
+		return -1;
 
-	if (conf_path == NULL)
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if (fd == -1)
 		return -1;
 
-	if (!file_exists(conf_path)) {
+	if (read(fd, mark, sizeof(*mark)) == sizeof(*mark) &&
+	    memcmp(mark->magic, MEMO_AGING_MAGIC, 4) == 0)
+		ret = 0;
 
-		free(conf_path);
+	close(fd);
 
-		return -1;
-	}
+	return ret;
+}
 
-	date = get_memo_conf_value("MARK_AS_DONE");
 
-	if (date == NULL) {
-		free(conf_path);
-		return -1;
-	}
+/* Returns 1 if the watermark says the memo file described by st has
+ * no notes older than threshold left to mark as done, 0 otherwise.
+ */
+static int aging_mark_is_fresh(uint32_t threshold, const struct stat *st)
+{
+	struct memo_aging_mark mark;
 
-	if (is_valid_date_format(date, 0) == -1) {
+	if (aging_mark_read(&mark) == -1)
+		return 0;
 
-		fail(stderr, "%s: error in ~/.memorc parsing\n", __func__);
-		free(date);
-		free(conf_path);
+	return mark.threshold == threshold &&
+		mark.memo_size == (uint64_t)st->st_size &&
+		mark.memo_mtime == memo_mtime_ns(st);
+}
 
-		return -1;
-	}
 
-	fp = get_memo_file_ptr("r");
-	lines = count_file_lines(fp);
+/* Write the .memo.aging watermark for the memo file described by st.
+ * Errors are ignored, the next run simply does the full pass again.
+ */
+static void aging_mark_save(uint32_t threshold, const struct stat *st)
+{
+	struct memo_aging_mark mark;
+	char *path = get_memo_sidecar_path(".aging");
+	int fd;
 
-	if (lines == -1) {
+	if (path == NULL)
+		return;
 
-		free(date);
-		free(conf_path);
+	memset(&mark, 0, sizeof(mark));
+	memcpy(mark.magic, MEMO_AGING_MAGIC, 4);
+	mark.threshold = threshold;
+	mark.memo_size = st->st_size;
+	mark.memo_mtime = memo_mtime_ns(st);
 
-		if (lines == -2)
-			fclose(fp);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	free(path);
 
-		return -1;
-	}
+	if (fd == -1)
+		return;
 
-	int id_array[lines];
-	int id_count = 0;
+	if (write(fd, &mark, sizeof(mark)) != sizeof(mark))
+		fail(stderr, "%s: error writing watermark\n", __func__);
 
-	/* Convert MARK_AS_DONE property value string
-	 * to a valid date */
-	strptime(date, "%Y-%m-%d", &dc);
-	date_to_compare = mktime(&dc);
+	close(fd);
+}
 
-	/* Compare each note line date with the one read
-	 * from the ~/.memorc and store note id for later use
-	 * if note date is older
-	 */
-	while (lines >= 0) {
-		char *line = read_file_line(fp);
 
-		if (line) {
+/* Remove the .memo.aging watermark. Called when Memo changes the memo
+ * file in a way that may leave notes older than the watermark undone.
+ */
+static void aging_mark_invalidate()
+{
+	char *path = get_memo_sidecar_path(".aging");
 
-			int id = get_note_id_from_line(line);
-			char *curr_date = get_note_date(line);
+	if (path == NULL)
+		return;
 
-			if (curr_date == NULL) {
-				free(line);
-				free(date);
-				free(conf_path);
-				fclose(fp);
-			}
+	if (file_exists(path))
+		remove(path);
 
-			time_t note_time;
-			struct tm nt = {0};
+	free(path);
+}
 
-			strptime(curr_date, "%Y-%m-%d", &nt);
-			note_time = mktime(&nt);
 
-			/* Store id codes of notes we want to mark as done
-			 * as we can't modify the file while we're reading it
-			 */
-			if (difftime(date_to_compare, note_time) > 0) {
-				id_array[id_count] = id;
-				id_count++;
-			}
+/* Move the watermark from memo file old to new after Memo itself
+ * changed it. notes are the len bytes appended to the memo file, or
+ * NULL when notes were only marked as done. The watermark is moved
+ * only if it was valid for old and none of the appended notes are
+ * older than the watermark.
+ */
+static void aging_mark_restamp(const struct stat *old, const struct stat *new,
+			       const char *notes, size_t len)
+{
+	struct memo_aging_mark mark;
+	struct memo_map map;
+	struct line_view line;
+	size_t pos = 0;
 
-			free(curr_date);
-		}
+	if (aging_mark_read(&mark) == -1 ||
+	    mark.memo_size != (uint64_t)old->st_size ||
+	    mark.memo_mtime != memo_mtime_ns(old))
+		return;
 
-		free(line);
+	map.data = (char *)notes;
+	map.size = notes ? len : 0;
 
-		lines--;
-	}
+	while (memo_map_next_line(&map, &pos, &line)) {
+		struct note_view note;
 
-	free(date);
-	free(conf_path);
-	fclose(fp);
+		if (parse_note(line.str, line.len, &note) == -1)
+			continue;
 
-	/* Loop through all the note id codes and mark corresponding
-	 * notes as DONE
-	 */
-	for (int i = 0; i < id_count; i++)
-		mark_note_status(DONE, id_array[i]);
+		uint32_t packed = note.packed_date;
 
-	return 0;
+		if (packed != 0 && packed < mark.threshold)
+			return;
+	}
+
+	aging_mark_save(mark.threshold, new);
 }
 
 
 /* Function returns the corresponding terminal
  * escape sequence of the color.
  */
-static char *color_to_escape_seq(char *color)
+static char *color_to_escape_seq(const char *color)
 {
 	#define red "\033[0;31m"
 	#define cyan "\033[0;36m"
@@ -1336,73 +6806,322 @@ static char *get_line_color(int is_odd_line)
 	return NULL;
 #endif
 
-	char *usecolors = NULL;
-	char *color = NULL;
-	char *defaultclr = NULL;
+	const char *usecolors = NULL;
+	const char *color = NULL;
 
-	/* Default LINE_COLOR/ODD_LINE_COLOR. */
-	defaultclr = "magenta";
+	usecolors = get_memo_conf_value(CONF_USE_COLORS);
+
+	if (!usecolors || strcmp(usecolors, "no") == 0)
+		return NULL;
 
 	if (is_odd_line)
-		defaultclr = "blue";
+		color = get_memo_conf_value(CONF_ODD_LINE_COLOR);
+	else
+		color = get_memo_conf_value(CONF_LINE_COLOR);
 
-	usecolors = get_memo_conf_value("USE_COLORS");
+	/* Default LINE_COLOR/ODD_LINE_COLOR. */
+	if (!color)
+		color = is_odd_line ? "blue" : "magenta";
 
-	if (!usecolors)
-		return NULL;
+	return color_to_escape_seq(color);
+}
 
-	if (strcmp(usecolors, "no") == 0) {
-		free(usecolors);
-		return NULL;
+/* Resolve the escape sequences of even and odd lines once, so
+ * outputting a line does not need to look at ~/.memorc. Colors are
+ * used only when stdout is a terminal.
+ */
+static void init_line_palette()
+{
+	line_palette.resolved = 1;
+
+	if (!isatty(STDOUT_FILENO))
+		return;
+
+	for (int i = 0; i < 2; i++) {
+		line_palette.color[i] = get_line_color(i);
+
+		if (line_palette.color[i])
+			line_palette.len[i] = strlen(line_palette.color[i]);
 	}
+}
 
-	if (is_odd_line)
-		color = get_memo_conf_value("ODD_LINE_COLOR");
-	else
-		color = get_memo_conf_value("LINE_COLOR");
 
-	if (!color) {
-		color = malloc((strlen(defaultclr) + 1) * sizeof(char));
-		if (!color) {
-			fail(stderr, "%s malloc failed\n", __func__);
-			return NULL;
+/* Write len bytes of data to fd, retrying after short writes.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int write_all(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, data, len);
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+
+/* Add len bytes of data to the output buffer. When the data doesn't
+ * fit, the buffer is written out first. Data larger than the buffer is
+ * written out with the buffer in one writev call without copying it.
+ */
+static void output_write(const char *data, size_t len)
+{
+	if (len <= sizeof(output_buffer.data) - output_buffer.len) {
+		memcpy(output_buffer.data + output_buffer.len, data, len);
+		output_buffer.len += len;
+		return;
+	}
+
+	if (len < sizeof(output_buffer.data)) {
+		output_flush();
+		memcpy(output_buffer.data, data, len);
+		output_buffer.len = len;
+		return;
+	}
+
+#ifdef _WIN32
+	output_flush();
+	write_all(STDOUT_FILENO, data, len);
+#else
+	struct iovec iov[2];
+	int first = 0;
+
+	/* Text printed with stdio comes before the buffer */
+	fflush(stdout);
+
+	iov[0].iov_base = output_buffer.data;
+	iov[0].iov_len = output_buffer.len;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	output_buffer.len = 0;
+
+	while (first < 2) {
+		ssize_t ret = writev(STDOUT_FILENO, iov + first, 2 - first);
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		/* Move past what was written */
+		for (; first < 2 && (size_t)ret >= iov[first].iov_len; first++)
+			ret -= iov[first].iov_len;
+
+		if (first < 2) {
+			iov[first].iov_base = (char *)iov[first].iov_base + ret;
+			iov[first].iov_len -= ret;
+		}
+	}
+#endif
+}
+
+
+/* Write out the output buffer. Called before anything else is written
+ * to stdout or stderr and at exit. Text printed with stdio is flushed
+ * first, it has been printed before the buffered notes.
+ */
+static void output_flush()
+{
+	fflush(stdout);
+
+	if (output_buffer.len == 0)
+		return;
+
+	/* Output is dropped if it can't be written, like stdio does */
+	write_all(STDOUT_FILENO, output_buffer.data, output_buffer.len);
+	output_buffer.len = 0;
+}
+
+
+/* Output len bytes of str as a JSON string. Runs of bytes which need no
+ * escape are copied as they are, json_escapes tells how the others are
+ * written.
+ */
+static void output_json_string(const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)str;
+	size_t run = 0;
+
+	output_write("\"", 1);
+
+	for (size_t i = 0; i < len; i++) {
+		char esc = json_escapes[p[i]];
+		char buf[6] = { '\\', esc, '0', '0', 0, 0 };
+
+		if (esc == 0)
+			continue;
+
+		output_write(str + run, i - run);
+		run = i + 1;
+
+		if (esc == 'u') {
+			buf[4] = hex[p[i] >> 4];
+			buf[5] = hex[p[i] & 0xf];
+			output_write(buf, 6);
+		} else {
+			output_write(buf, 2);
 		}
+	}
+
+	output_write(str + run, len - run);
+	output_write("\"", 1);
+}
+
+
+/* Output len bytes of str as the content field of a tsv record. Tabs,
+ * new lines and backslashes are written as \t, \n and \\, so every
+ * tab of the record separates fields. With nul_only, for tsv0, the
+ * bytes are written as they are except NUL bytes, which are left out,
+ * as a NUL ends the record.
+ */
+static void output_tsv_content(const char *str, size_t len, int nul_only)
+{
+	size_t run = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		char buf[2] = { '\\', 0 };
+
+		if (nul_only ? str[i] != '\0' :
+		    str[i] != '\t' && str[i] != '\n' && str[i] != '\\')
+			continue;
 
-		strcpy(color, defaultclr);
+		output_write(str + run, i - run);
+		run = i + 1;
+
+		if (nul_only)
+			continue;
+
+		buf[1] = str[i] == '\t' ? 't' : str[i] == '\n' ? 'n' : '\\';
+		output_write(buf, 2);
 	}
 
-	char *value = color_to_escape_seq(color);
-	free(color);
-	free(usecolors);
+	output_write(str + run, len - run);
+}
+
+
+/* Output a note line in the format of --format, see OutputFormat_t.
+ * Malformed lines are reported and left out, they can't be split to
+ * the fields.
+ */
+static void output_record(const char *line, size_t len)
+{
+	struct note_view note;
+	char id[16];
+
+	if (parse_note(line, len, &note) == -1) {
+		report_malformed_note(__func__, line, len);
+		return;
+	}
 
-	return value;
+	switch (memo_opts.format) {
+	case FORMAT_JSONL:
+		output_write("{\"id\":", 6);
+		output_write(id, snprintf(id, sizeof(id), "%d", note.id));
+		output_write(",\"status\":", 10);
+		output_json_string(note.status_str.str, note.status_str.len);
+		output_write(",\"date\":", 8);
+		output_json_string(note.date.str, note.date.len);
+		output_write(",\"content\":", 11);
+		output_json_string(note.content.str, note.content.len);
+		output_write("}\n", 2);
+		break;
+	case FORMAT_TSV:
+	case FORMAT_TSV0:
+		/* id, status and date have no tabs, copy them as they are */
+		output_write(line, note.content.str - line);
+		output_tsv_content(note.content.str, note.content.len,
+				   memo_opts.format == FORMAT_TSV0);
+		output_write(memo_opts.format == FORMAT_TSV ? "\n" : "", 1);
+		break;
+	default:
+		break;
+	}
 }
 
-static void output(char *line, int is_odd_line)
+
+/* Output one note line of len bytes. The line does not need to be
+ * NUL terminated.
+ */
+static void output(const char *line, size_t len, int is_odd_line)
 {
-	char *color = NULL;
+	int i = is_odd_line ? 1 : 0;
+
+	if (output_is_skipping()) {
+		output_page.skipped++;
+		return;
+	}
+
+	if (output_is_done())
+		return;
+
+	output_page.shown++;
 
-	color = get_line_color(is_odd_line);
+	/* Only counted, nothing is formatted */
+	if (memo_opts.count_mode != COUNT_OFF)
+		return;
 
-	if (!color) {
-		printf("%s\n", line);
+	if (memo_opts.format != FORMAT_TEXT) {
+		output_record(line, len);
+		return;
+	}
+
+	if (!line_palette.resolved)
+		init_line_palette();
+
+	if (!line_palette.color[i]) {
+		output_write(line, len);
+		output_write("\n", 1);
 	} else {
-		printf("%s%s\n", color, line);
+		output_write(line_palette.color[i], line_palette.len[i]);
+		output_write(line, len);
 		/* Reset terminal colors */
-		printf("\033[0m");
+		output_write(COLOR_RESET_NEWLINE,
+			     sizeof(COLOR_RESET_NEWLINE) - 1);
 	}
 }
 
 
+/* Check if the notes left don't need to be looked at. --exists stops
+ * at the first note found and --limit after the given count of notes.
+ */
+static int output_is_done()
+{
+	if (memo_opts.count_mode == COUNT_EXISTS && output_page.shown > 0)
+		return 1;
+
+	return memo_opts.has_limit && output_page.shown >= memo_opts.limit;
+}
+
+
+/* Check if the next note is left out because of --offset */
+static int output_is_skipping()
+{
+	return output_page.skipped < memo_opts.offset;
+}
+
+
 /* This functions handles the output of one line.
  * Postponed notes are ignored.
  *
  * Set is_odd_line to 1 if the line to be outputted is odd.
  */
-static void output_default(char *line, int is_odd_line)
+static void output_default(const char *line, size_t len, int is_odd_line)
 {
-	if (get_note_status(line) != POSTPONED)
-		output(line, is_odd_line);
+	if (get_note_status(line, len) != POSTPONED)
+		output(line, len, is_odd_line);
 }
 
 
@@ -1412,10 +7131,10 @@ static void output_default(char *line, int is_odd_line)
  *
  * Set is_odd_line to 1 if the line to be outputted is odd.
  */
-static void output_postponed(char *line, int is_odd_line)
+static void output_postponed(const char *line, size_t len, int is_odd_line)
 {
-	if (get_note_status(line) == POSTPONED)
-		output(line, is_odd_line);
+	if (get_note_status(line, len) == POSTPONED)
+		output(line, len, is_odd_line);
 }
 
 
@@ -1424,43 +7143,32 @@ static void output_postponed(char *line, int is_odd_line)
  *
  * Set is_odd_line to 1 if the line to be outputted is odd.
  */
-static void output_undone(char *line, int is_odd_line)
+static void output_undone(const char *line, size_t len, int is_odd_line)
 {
-	if (get_note_status(line) == UNDONE)
-		output(line, is_odd_line);
+	if (get_note_status(line, len) == UNDONE)
+		output(line, len, is_odd_line);
 }
 
 
 /* Functions outputs one note line without the date part */
-static void output_without_date(char *line, int is_odd_line)
+static void output_without_date(const struct note_view *note, int is_odd_line)
 {
-	char *token = strtok(line, "\t");
-
-	if (token != NULL)
-		printf("\t%s\t", token);
-	else
-		goto error;
-
-	token = strtok(NULL, "\t");
-
-	if (token != NULL)
-		printf("%s\t", token);
-	else
-		goto error;
-
-	token = strtok(NULL, "\t");
-	token = strtok(NULL, "\t");
-
-	if (token != NULL)
-		output(token, is_odd_line);
-	else
-		goto error;
-
-	return;
-
-error:
-	fail(stderr, "%s parsing line failed\n", __func__);
+	/* Records of machine readable formats are always whole. Notes
+	 * left out or only counted are handled by output.
+	 */
+	if (memo_opts.format != FORMAT_TEXT ||
+	    memo_opts.count_mode != COUNT_OFF ||
+	    output_is_skipping() || output_is_done()) {
+		output(note->line.str, note->line.len, is_odd_line);
+		return;
+	}
 
+	output_write("\t", 1);
+	output_write(note->id_str.str, note->id_str.len);
+	output_write("\t", 1);
+	output_write(note->status_str.str, note->status_str.len);
+	output_write("\t", 1);
+	output(note->content.str, note->content.len, is_odd_line);
 }
 
 
@@ -1470,27 +7178,24 @@ error:
 static const char *export_html(const char *path)
 {
 	FILE *fp = NULL;
-	FILE *fpm = NULL;
-	char *line = NULL;
-	int lines = 0;
-
-	fp = fopen(path, "w");
+	struct memo_map map;
+	struct line_view line;
+	size_t pos = 0;
 
-	if (!fp) {
-		fail(stderr, "%s: failed to open %s\n", __func__, path);
+	if (memo_map_open(&map) == -1)
 		return NULL;
-	}
 
-	fpm = get_memo_file_ptr("r");
-	lines = count_file_lines(fpm);
-
-	if (lines == -1) {
-		fail(stderr, "%s: counting lines failed\n", __func__);
+	if (map.size == 0) {
+		printf("Nothing to export.\n");
+		memo_map_close(&map);
 		return NULL;
 	}
 
-	if (lines == -2) {
-		printf("Nothing to export.\n");
+	fp = fopen(path, "w");
+
+	if (!fp) {
+		fail(stderr, "%s: failed to open %s\n", __func__, path);
+		memo_map_close(&map);
 		return NULL;
 	}
 
@@ -1503,21 +7208,15 @@ static const char *export_html(const char *path)
 	fprintf(fp, "<h1>Notes from Memo</h1>\n");
 	fprintf(fp, "<table>\n");
 
-	while (lines >= 0) {
-		line = read_file_line(fpm);
-
-		if (line) {
-			fprintf(fp, "<tr><td><pre>%s</pre></td></tr>\n",
-				line);
-			free(line);
-		}
-
-		lines--;
+	while (memo_map_next_line(&map, &pos, &line)) {
+		fputs("<tr><td><pre>", fp);
+		fwrite(line.str, 1, line.len, fp);
+		fputs("</pre></td></tr>\n", fp);
 	}
 
 	fprintf(fp, "</table>\n</body>\n</html>\n");
 	fclose(fp);
-	fclose(fpm);
+	memo_map_close(&map);
 
 	return path;
 }
@@ -1533,99 +7232,84 @@ static const char *export_html(const char *path)
 static const char *export_csv(const char *path)
 {
 	FILE *fp = NULL;
-	FILE *fpm = NULL;
-	char *line = NULL;
-	int lines = 0;
-
-	fp = fopen(path, "w");
+	struct memo_map map;
+	struct line_view line;
+	size_t pos = 0;
 
-	if(!fp) {
-		fail(stderr, "%s failed to open %s\n", __func__, path);
+	if (memo_map_open(&map) == -1)
 		return NULL;
-	}
 
-	fpm = get_memo_file_ptr("r");
-	lines = count_file_lines(fpm);
-
-	if(lines == -1) {
-		fail(stderr, "%s: counting lines failed\n", __func__);
+	/* Ignore empty file and return */
+	if (map.size == 0) {
+		printf("Nothing to export.\n");
+		memo_map_close(&map);
 		return NULL;
 	}
 
-	/* Ignore empty file and return */
-	if(lines == -2) {
-		printf("Nothing to export.\n");
+	fp = fopen(path, "w");
+
+	if(!fp) {
+		fail(stderr, "%s failed to open %s\n", __func__, path);
+		memo_map_close(&map);
 		return NULL;
 	}
 
 	fprintf(fp, "ID,Status,Date,Content\n");
 
-	while (lines >= 0) {
-		line = read_file_line(fpm);
-		if (line) {
-			/* Replace each occurence of tab character
-			 * with a comma.
-			 */
-			for (int i = 0; i < strlen(line); i++) {
-				if (line[i] == '\t')
-					line[i] = ',';
-			}
+	while (memo_map_next_line(&map, &pos, &line)) {
+		const char *p = line.str;
+		const char *end = line.str + line.len;
+		const char *tab;
 
-			fprintf(fp, "%s\n", line);
-			free(line);
+		/* Write the line replacing each occurence of tab
+		 * character with a comma.
+		 */
+		while ((tab = scan_byte(p, end - p, '\t')) != NULL) {
+			fwrite(p, 1, tab - p, fp);
+			putc(',', fp);
+			p = tab + 1;
 		}
 
-		lines--;
+		fwrite(p, 1, end - p, fp);
+		putc('\n', fp);
 	}
 
 	fclose(fp);
-	fclose(fpm);
+	memo_map_close(&map);
 
 	return path;
 }
 
 
-/* Show latest n notes */
+/* Show latest n notes. Only the last n lines are read from the end of
+ * the file, see memo_map_open_tail. When n is smaller than zero all
+ * notes are shown.
+ */
 static void show_latest(int n)
 {
-	FILE *fp = NULL;
-	char *line;
-	int lines = 0;
-	int start;
-	int current = 0;
+	struct memo_map map;
+	struct line_view line;
+	size_t pos = 0;
 	int output_count = 0;
+	int ret;
 
-	fp = get_memo_file_ptr("r");
-
-	lines = count_file_lines(fp);
-
-	if (lines != -1) {
-		/* If n is bigger than the count of lines or smaller
-		 * than zero we will show all the lines.
-		 */
-		if (n > lines || n < 0)
-			start = -1;
-		else
-			start = lines - n;
+	/* When n is zero nothing is shown */
+	if (n == 0)
+		return;
 
-		while (lines >= 0) {
-			line = read_file_line(fp);
+	ret = n < 0 ? memo_map_open(&map) : memo_map_open_tail(&map, n);
 
-			if (line) {
-				if (current > start) {
-					output_count++;
-					output(line, is_odd(output_count));
-				}
-				free(line);
-			}
+	if (ret == -1) {
+		fail(stderr, "%s: reading notes failed\n", __func__);
+		return;
+	}
 
-			lines--;
-			current++;
-		}
+	while (memo_map_next_line(&map, &pos, &line)) {
+		output_count++;
+		output(line.str, line.len, is_odd(output_count));
+	}
 
-		fclose(fp);
-	} else
-		fail(stderr,"%s: counting lines failed\n", __func__);
+	memo_map_close(&map);
 }
 
 
@@ -1635,18 +7319,13 @@ static void show_latest(int n)
  */
 static int delete_all()
 {
-	char *confirm = NULL;
+	const char *confirm = NULL;
 	int ask = 1;
 
-	confirm = get_memo_conf_value("MEMO_CONFIRM_DELETE");
-
-	if (confirm) {
+	confirm = get_memo_conf_value(CONF_MEMO_CONFIRM_DELETE);
 
-		if (strcmp(confirm, "no") == 0)
-			ask = 0;
-
-		free(confirm);
-	}
+	if (confirm && strcmp(confirm, "no") == 0)
+		ask = 0;
 
 	char *path = get_memo_file_path();
 
@@ -1664,10 +7343,14 @@ static int delete_all()
 					"%s error removing %s\n", __func__,
 					path);
 			}
+			memo_index_invalidate();
+			search_index_invalidate();
 		}
 	} else {
 		if (remove(path) != 0)
 			fail(stderr,"%s error removing %s\n", __func__, path);
+		memo_index_invalidate();
+		search_index_invalidate();
 	}
 
 	free(path);
@@ -1739,85 +7422,78 @@ static char *get_memo_conf_path()
  *
  * e.g MEMO_PATH=/home/niko/.memo
  *
- * This function returns the value of the property. NULL is returned on
- * failure. On success, caller must free the return value.
+ * The file is read once, on the first call, and the values of the
+ * known properties are kept in memo_conf_values.
+ *
+ * This function returns the value of the property. NULL is returned if
+ * the property is not set. Caller must not free the return value.
+ */
+static const char *get_memo_conf_value(MemoConf_t prop)
+{
+	if (!memo_conf_loaded)
+		load_memo_conf();
+
+	return memo_conf_values[prop];
+}
+
+
+/* Read ~/.memorc and store values of the properties listed in
+ * memo_conf_names to memo_conf_values. When a property is set more than
+ * once, the first one is used.
  */
-static char *get_memo_conf_value(const char *prop)
+static void load_memo_conf()
 {
-	char *retval = NULL;
 	char *conf_path = NULL;
 	FILE *fp = NULL;
+	char *line = NULL;
+
+	memo_conf_loaded = 1;
 
 	conf_path = get_memo_conf_path();
 
 	if (conf_path == NULL)
-		return NULL;
+		return;
 
 	fp = fopen(conf_path, "r");
+	free(conf_path);
 
-	if (fp == NULL) {
-		free(conf_path);
-		return NULL;
-	}
-
-	int lines = count_file_lines(fp);
-
-	if (lines == -1) {
-		fail(stderr, "%s: counting lines failed\n", __func__);
-		fclose(fp);
-		free(conf_path);
-
-		return NULL;
-	}
-
-	while (lines >= 0) {
-
-		char *line = read_file_line(fp);
-
-		if (line) {
-			if (strncmp(line, prop, strlen(prop)) == 0) {
-
-				/* Property found, get the value */
-				char *token = strtok(line, "=");
-				token = strtok(NULL, "=");
-
-				if (token == NULL) {
-					/* property does not have
-					 * a value. fail.
-					 */
-					fail(stderr, "%s: no value\n", prop);
-					free(line);
-
-					break;
-				}
+	if (fp == NULL)
+		return;
 
-				size_t len = strlen(token) + 1;
-				retval = malloc(len * sizeof(char));
+	memo_conf_exists = 1;
 
-				if (retval == NULL) {
-					fail(stderr,"%s malloc\n", __func__);
-					free(line);
+	while (!feof(fp) && (line = read_file_line(fp)) != NULL) {
+		for (int i = 0; i < CONF_COUNT; i++) {
+			const char *name = memo_conf_names[i];
 
-					break;
-				}
+			if (memo_conf_values[i] ||
+			    strncmp(line, name, strlen(name)) != 0)
+				continue;
 
-				strcpy(retval, token);
-				free(line);
+			/* Property found, get the value */
+			char *token = strtok(line, "=");
+			token = strtok(NULL, "=");
 
+			if (token == NULL) {
+				/* property does not have
+				 * a value. fail.
+				 */
+				fail(stderr, "%s: no value\n", name);
 				break;
-
 			}
 
-			free(line);
+			memo_conf_values[i] = strdup(token);
+
+			if (memo_conf_values[i] == NULL)
+				fail(stderr, "%s strdup failed\n", __func__);
+
+			break;
 		}
 
-		lines--;
+		free(line);
 	}
 
 	fclose(fp);
-	free(conf_path);
-
-	return retval;
 }
 
 
@@ -1891,21 +7567,17 @@ static char *get_memo_file_path()
 		return path;
 	}
 
-	char *conf_path = NULL;
-
-	conf_path = get_memo_conf_path();
-
-	if (conf_path == NULL)
-		return NULL;
+	const char *conf_value = get_memo_conf_value(CONF_MEMO_PATH);
 
-	if (!file_exists(conf_path)) {
+	if (!memo_conf_exists) {
 		/* Config file not found, so fallback to ~/.memo */
 		path = get_memo_default_path();
 
 	} else {
 		/* Configuration file found, read .memo location
 		   from it */
-		path = get_memo_conf_value("MEMO_PATH");
+		if (conf_value)
+			path = strdup(conf_value);
 
 		if (path == NULL) {
 			/* Failed to get the path. Most likely user did not
@@ -1920,8 +7592,6 @@ static char *get_memo_file_path()
 
 	}
 
-	free(conf_path);
-
 	return path;
 }
 
@@ -1932,26 +7602,39 @@ static char *get_memo_file_path()
  * Returns NULL on failure.
  */
 static char *get_temp_memo_path()
+{
+	return get_memo_sidecar_path(".tmp");
+}
+
+
+/* Returns the path of a file living next to the .memo file, for
+ * example .memo.tmp or .memo.idx. suffix is appended to the path of
+ * the memo file.
+ *
+ * Returns NULL on failure. Caller is responsible for freeing the
+ * return value.
+ */
+static char *get_memo_sidecar_path(const char *suffix)
 {
 	char *orig = get_memo_file_path();
 
 	if (orig == NULL)
 		return NULL;
 
-	char *tmp = malloc(sizeof(char) * (strlen(orig) + 5));
+	char *path = malloc(sizeof(char) * (strlen(orig) + strlen(suffix) + 1));
 
-	if (tmp == NULL) {
+	if (path == NULL) {
 		free(orig);
 		fail(stderr,"%s: malloc failed\n", __func__);
 		return NULL;
 	}
 
-	strcpy(tmp, orig);
-	strcat(tmp, ".tmp");
+	strcpy(path, orig);
+	strcat(path, suffix);
 
 	free(orig);
 
-	return tmp;
+	return path;
 }
 
 
@@ -1976,16 +7659,31 @@ static void remove_content_newlines(char *content)
 /* Replaces part of the note.
  * data is the new part defined by NotePart_t.
  *
- * Original note line is modified.
- *
  * Caller is responsible for freeing the return value.
  * Returns new note line on success, NULL on failure.
  */
-static char *note_part_replace(NotePart_t part, char *note_line, const char *data)
+static char *note_part_replace(NotePart_t part, const struct note_view *note,
+			       const char *data)
 {
+	struct line_view id = note->id_str;
+	struct line_view date = note->date;
+	struct line_view content = note->content;
+	struct line_view new_data;
 	char *new_line = NULL;
-	int size = ((strlen(note_line) + strlen(data)) + 1) * sizeof(char);
+	size_t size;
+
+	new_data.str = data;
+	new_data.len = strlen(data);
 
+	if (part == NOTE_ID)
+		id = new_data;
+	else if (part == NOTE_DATE)
+		date = new_data;
+	else if (part == NOTE_CONTENT)
+		content = new_data;
+
+	/* Three tabs, status and \0 */
+	size = id.len + date.len + content.len + 5;
 	new_line = malloc(size);
 
 	if (new_line == NULL) {
@@ -1993,210 +7691,62 @@ static char *note_part_replace(NotePart_t part, char *note_line, const char *dat
 		return NULL;
 	}
 
-	char *token = NULL;
-
-	/* Get the id and copy it */
-	if ((token = strtok(note_line, "\t")) != NULL) {
-		if (part == NOTE_ID) {
-			/* Replace the original id with data */
-			if (sprintf(new_line, "%s\t", data) < 0)
-				goto error_clean_up;
-		} else {
-			/* Copy the original id */
-			if (sprintf(new_line, "%s\t", token) < 0)
-				goto error_clean_up;
-		}
-	} else {
-		goto error_clean_up;
-	}
-
-	/* Get the status code and copy it */
-	if ((token = strtok(NULL, "\t")) != NULL) {
-		if (sprintf(new_line + strlen(new_line), "%s\t", token) < 0)
-			goto error_clean_up;
-	} else {
-		goto error_clean_up;
-	}
-
-	/* Get the original date */
-	if ( (token = strtok(NULL, "\t")) == NULL)
-		goto error_clean_up;
-
-	if (part == NOTE_DATE) {
-		/* Copy data as the new date */
-		if (sprintf(new_line + strlen(new_line), "%s\t", data) < 0)
-			goto error_clean_up;
-
-	} else {
-		/* Copy the original date */
-		if (sprintf(new_line + strlen(new_line), "%s\t", token) < 0)
-			goto error_clean_up;
-	}
-
-	/* Get the original note content */
-	if ( (token = strtok(NULL, "\t")) == NULL)
-		goto error_clean_up;
-
-	if (part == NOTE_CONTENT) {
-		/* Copy the data as new content */
-		if (sprintf(new_line + strlen(new_line), "%s", data) < 0)
-			goto error_clean_up;
-	} else {
-		/* Copy the original note content, do not write \n because
-		 * the token has it already.
-		 */
-		if (sprintf(new_line + strlen(new_line), "%s", token) < 0)
-			goto error_clean_up;
-	}
+	snprintf(new_line, size, "%.*s\t%c\t%.*s\t%.*s",
+		 (int)id.len, id.str, note->status_str.str[0],
+		 (int)date.len, date.str, (int)content.len, content.str);
 
 	return new_line;
-
-error_clean_up:
-	fail(stderr, "%s: replacing note data failed\n", __func__);
-	free(new_line);
-
-	return NULL;
 }
 
 
 /* Function replaces a note content with data.
  *
- * Data can be either a valid date or content.  Replace operation is
- * simply done by creating a temporary file, existing notes are written
- * line by line to it. Line that has matching id will be written with
- * new data. Then the original memo file is replaced with the temporary
- * one.
+ * Data can be either a valid date or content.  The note is looked up
+ * using the note index and only the line of the note is replaced, see
+ * splice_memo_file.
  *
  * Returns 0 on success, -1 on failure.
  */
 static int replace_note(int id, const char *data)
 {
-	FILE *tmpfp = NULL;
-	FILE *fp = NULL;
-	char *memofile = NULL;
-	char *tmpfile = NULL;
-	int lines = 0;
-
-	tmpfp = get_memo_tmpfile_ptr();
-
-	if (tmpfp == NULL)
-		return -1;
-
-	fp = get_memo_file_ptr("r");
-
-	lines = count_file_lines(fp);
-
-	if (lines == -1) {
-		fail(stderr, "%s: counting lines failed\n", __func__);
-		fclose(tmpfp);
+	char *line = NULL;
+	char *new_line = NULL;
+	off_t offset;
+	size_t len;
+	int ret;
 
-		return -1;
-	}
+	struct note_view note;
 
-	/* Empty file, ignore. */
-	if (lines == -2) {
-		fclose(fp);
-		fclose(tmpfp);
+	line = get_note_by_id(id, &offset, &len);
 
+	if (line == NULL)
 		return -1;
-	}
-
-	memofile = get_memo_file_path();
-
-	if (memofile == NULL) {
-		fail(stderr, "%s failed to get memo file path\n", __func__);
-		fclose(fp);
-		fclose(tmpfp);
 
+	if (parse_note(line, len, &note) == -1) {
+		report_malformed_note(__func__, line, len);
+		free(line);
 		return -1;
 	}
 
-	tmpfile = get_temp_memo_path();
-
-	if (tmpfile == NULL) {
-		fail(stderr, "%s failed to get memo tmp path\n", __func__);
-		fclose(fp);
-		fclose(tmpfp);
+	/* Check if user wants to replace the date by validating the
+	 * data as date. Otherwise assume content is being replaced.
+	 */
+	if (is_valid_date_format(data, 1) == 0)
+		new_line = note_part_replace(NOTE_DATE, &note, data);
+	else
+		new_line = note_part_replace(NOTE_CONTENT, &note, data);
 
-		free(memofile);
+	free(line);
 
+	if (new_line == NULL) {
+		printf("Unable to replace note %d\n", id);
 		return -1;
 	}
 
-	while (lines >= 0) {
-		char *line = read_file_line(fp);
-
-		if (line) {
-
-			int curr_id = get_note_id_from_line(line);
-			if (curr_id == id) {
-				/* Found the note to be replaced
-				 * Check if user wants to replace the date
-				 * by validating the data as date. Otherwise
-				 * assume content is being replaced.
-				 */
-				if (is_valid_date_format(data, 1) == 0) {
-					char *new_line = NULL;
-					new_line = note_part_replace(NOTE_DATE,
-								line, data);
-					if (new_line == NULL) {
-
-						printf("Unable to replace note %d\n", id);
-
-						free(memofile);
-						free(tmpfile);
-						fclose(fp);
-						fclose(tmpfp);
-
-						return -1;
-					}
-
-					fprintf(tmpfp, "%s\n", new_line);
-					free(new_line);
-
-				} else {
-					char *new_line = NULL;
-					new_line = note_part_replace(NOTE_CONTENT,
-								line, data);
-
-					if (new_line == NULL) {
-
-						printf("Unable to replace note %d\n", id);
-
-						free(memofile);
-						free(tmpfile);
-						fclose(fp);
-						fclose(tmpfp);
-
-						return -1;
-					}
-
-					fprintf(tmpfp, "%s\n", new_line);
-					free(new_line);
-				}
-			} else {
-				fprintf(tmpfp, "%s\n", line);
-			}
-
-			free(line);
-		}
-
-		lines--;
-	}
-
-	fclose(fp);
-	fclose(tmpfp);
-
-	if (file_exists(memofile))
-		remove(memofile);
-
-	rename(tmpfile, memofile);
-	remove(tmpfile);
-
-	free(memofile);
-	free(tmpfile);
+	ret = splice_memo_file(offset, len, new_line);
+	free(new_line);
 
-	return 0;
+	return ret;
 }
 
 
@@ -2302,6 +7852,20 @@ static int organize_note_identifiers()
 			 */
 			char *new_line = NULL;
 			char *id = integer_to_string(id_counter);
+			struct note_view note;
+
+			if (line[0] == '\0' ||
+			    parse_note(line, strlen(line), &note) == -1) {
+				/* Keep the line as it is */
+				if (line[0] != '\0')
+					report_malformed_note(__func__, line,
+							      strlen(line));
+				fprintf(tmpfp, "%s\n", line);
+				free(id);
+				free(line);
+				lines--;
+				continue;
+			}
 
 			if (id == NULL) {
 				fail(stderr, "%s: fatal error\n", __func__);
@@ -2312,7 +7876,7 @@ static int organize_note_identifiers()
 				return -1;
 			}
 
-			new_line = note_part_replace(NOTE_ID, line, id);
+			new_line = note_part_replace(NOTE_ID, &note, id);
 
 			if (new_line == NULL) {
 				fail(stderr, "%s: fatal error\n", __func__);
@@ -2343,6 +7907,9 @@ static int organize_note_identifiers()
 	rename(tmpfile, memofile);
 	remove(tmpfile);
 
+	memo_index_invalidate();
+	search_index_invalidate();
+
 	free(memofile);
 	free(tmpfile);
 
@@ -2367,11 +7934,12 @@ static int organize_note_identifiers()
  */
 static int add_note(char *content, const char *date)
 {
-	FILE *fp = NULL;
 	time_t t;
 	struct tm *ti;
 	int id = -1;
 	char note_date[11];
+	char *line = NULL;
+	int len;
 
 	/* Do not add an empty note */
 	if (strlen(content) == 0)
@@ -2379,36 +7947,33 @@ static int add_note(char *content, const char *date)
 
 	remove_content_newlines(content);
 
-	fp = get_memo_file_ptr("a");
-
-	if (fp == NULL) {
-		fail(stderr,"%s: Error opening ~/.memo\n", __func__);
-		return -1;
-	}
-
 	id = get_next_id();
 
 	if (id == -1)
 		id = 1;
 
-	if (date != NULL) {
-		/* Date is already validated, so just copy it
-		 * for later use.
-		 */
-		strcpy(note_date, date);
-	} else {
-
+	if (date == NULL) {
 		time(&t);
 		ti = localtime(&t);
 
 		strftime(note_date, 11, "%Y-%m-%d", ti);
+		date = note_date;
 	}
 
+	/* Room for id, status, date and separators */
+	line = malloc(strlen(content) + strlen(date) + 32);
+
+	if (line == NULL) {
+		fail(stderr, "%s: malloc failed\n", __func__);
+		return -1;
+	}
 
-	fprintf(fp, "%d\t%s\t%s\t%s\n", id, "U", note_date,
-		content);
+	len = sprintf(line, "%d\t%s\t%s\t%s\n", id, "U", date, content);
 
-	fclose(fp);
+	if (append_notes(line, len) == -1)
+		id = -1;
+
+	free(line);
 
 	return id;
 }
@@ -2429,8 +7994,18 @@ OPTIONS\n\
     -e, --export <format> <path>              Export notes a file\n\
                                               Format must be either csv or html\n\
     -f, --search <search>                     Find notes by search term\n\
+        --any                                 Find notes with any word of <search>\n\
+        --all                                 Find notes with all words of <search>\n\
+        --fuzzy <k>                           Find notes with <search> at most k edits away\n\
+        --rank[=k]                            Show the k most relevant notes found, best first\n\
+        --format <format>                     Show notes as text, jsonl, tsv or tsv0\n\
+        --count                               Show only the count of notes listed or found\n\
+        --exists                              Exit with 0 if any note is found, 1 otherwise\n\
+        --offset <k>                          Leave out the first k notes listed or found\n\
+        --limit <n>                           Show at most n notes\n\
     -F, --regex <regex>                       Find notes by regular expression\n\
     -i, --stdin                               Read from stdin until ^D\n\
+    -j, --jobs <n>                            Search and filter notes with n threads\n\
     -l, --latest <n>                          Show latest n notes\n\
     -m, --set-done <id>                       Mark note status as done\n\
     -M, --set-undone <id>                     Mark note status as undone\n\
@@ -2438,6 +8013,7 @@ OPTIONS\n\
     -O, --organize                            Reorder and organize note id codes\n\
     -p, --path                                Show current memo file path\n\
     -P, --postpone [id]                       Show postponed or mark note as postponed\n\
+    -q, --query <query>                       Find notes matching query, see memo(1)\n\
     -R, --delete-done                         Delete all notes marked as done\n\
     -r, --replace <id> [content]/[yyyy-MM-dd] Replace note content or date\n\
     -s, --list                                Show all notes except postponed\n\
@@ -2481,63 +8057,106 @@ static void show_memo_file_path()
 }
 
 
-/* Function sorts the dates elements in the order of date.
+/* Read the options which modify other options to memo_opts. They
+ * apply no matter where they are on the command line, so they must be
+ * known before the first action is run.
+ *
+ * The leading '-' in optstring keeps getopt from reordering argv, the
+ * actual option loop in main reads the same argv again.
  *
- * Make the *dates[] again.
+ * Returns 0 on success, -1 if an option has an invalid value.
  */
-static void sort_dates_ascend(char *dates[], int date_index)
+static int read_modifier_options(int argc, char *argv[],
+				 const struct option *long_options)
 {
-  int dates_int[date_index];
-
-  /* Remove "-" from the dates elements and convert them into integer. */
-  for (int i = 0; i < date_index; i++) {
-		char *p = dates[i], *q = dates[i];
-		while((*p = *q++)) p += (*p != '-');
-		dates_int[i] = atoi(dates[i]);
-  }
+	int ret = 0;
+	int c;
 
-  /* Sort the dates_int elements in ascending order. */
-  qsort((void *)dates_int , date_index , sizeof(dates_int[0]), int_sort);
+	while ((c = getopt_long(argc, argv, "-a:d:De:f:F:hij:l:m:M:oOpPq:r:RsTuV",
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case OPT_ANY:
+			memo_opts.match_all = 0;
+			break;
+		case OPT_ALL:
+			memo_opts.match_all = 1;
+			break;
+		case OPT_FUZZY:
+			memo_opts.fuzzy = 1;
+			memo_opts.max_distance = atoi(optarg);
+
+			if (memo_opts.max_distance < 0 ||
+			    memo_opts.max_distance > FUZZY_MAX_LEN) {
+				fail(stderr, "--fuzzy must be between 0 and %d\n",
+					FUZZY_MAX_LEN);
+				ret = -1;
+			}
+			break;
+		case OPT_RANK:
+			memo_opts.rank = optarg ? atoi(optarg) : RANK_DEFAULT;
 
-  /* For each of dates_int elements,
-   * make a string in valid date format ("yyyy-mm-dd") and reallocate it to dates.
-   */
-  for (int i = 0; i < date_index; i++) {
-		dates[i][0] = '\0';
+			if (memo_opts.rank < 1) {
+				fail(stderr, "--rank must be at least 1\n");
+				ret = -1;
+			}
+			break;
+		case OPT_FORMAT: {
+			int i = 0;
 
-		/* Pick up the 4-digit year from dates_int[i]. */
-		strcat(dates[i], integer_to_string(dates_int[i]/10000000));
-		strcat(dates[i], integer_to_string((dates_int[i]/1000000) % 10));
-		strcat(dates[i], integer_to_string((dates_int[i]/100000) % 10));
-		strcat(dates[i], integer_to_string((dates_int[i]/10000) % 10));
-		strcat(dates[i], "-");
+			while (i < FORMAT_COUNT &&
+			       strcmp(optarg, output_format_names[i]) != 0)
+				i++;
 
-		/* Pick up the 2-digit month from dates_int[i]. */
-		strcat(dates[i], integer_to_string((dates_int[i]/1000) % 10));
-		strcat(dates[i], integer_to_string((dates_int[i]/100) % 10));
-		strcat(dates[i], "-");
+			if (i == FORMAT_COUNT) {
+				fail(stderr, "--format must be text, jsonl, tsv or tsv0\n");
+				ret = -1;
+			} else {
+				memo_opts.format = i;
+			}
+			break;
+		}
+		case OPT_COUNT:
+			memo_opts.count_mode = COUNT_NOTES;
+			break;
+		case OPT_OFFSET:
+		case OPT_LIMIT: {
+			char *end = NULL;
+			long n = strtol(optarg, &end, 10);
+
+			if (*optarg == '\0' || *end != '\0' || n < 0) {
+				fail(stderr, "--%s must be a count of notes\n",
+					c == OPT_OFFSET ? "offset" : "limit");
+				ret = -1;
+				break;
+			}
 
-		/* Pick up the 2-digit day from dates_int[i]. */
-		strcat(dates[i], integer_to_string((dates_int[i]/10) % 10));
-		strcat(dates[i], integer_to_string(dates_int[i] % 10));
-  }
-}
+			if (c == OPT_OFFSET) {
+				memo_opts.offset = n;
+			} else {
+				memo_opts.limit = n;
+				memo_opts.has_limit = 1;
+			}
+			break;
+		}
+		case OPT_EXISTS:
+			memo_opts.count_mode = COUNT_EXISTS;
+			break;
+		case 'j':
+			memo_opts.jobs = atoi(optarg);
 
+			if (memo_opts.jobs < 1 || memo_opts.jobs > MAX_JOBS) {
+				fail(stderr, "-j must be between 1 and %d\n",
+					MAX_JOBS);
+				ret = -1;
+			}
+			break;
+		}
+	}
 
-/* Comparator function needed for qsort function.
- *
- * Returns 1 if *a > *b, 0 if *a = *b, -1 if *a < *b.
- */
-static int int_sort(const void *a, const void *b)
-{
-    if (*(int *)a < *(int *)b) {
-        return -1;
-    }
-    else if (*(int *)a == *(int *)b) {
-        return 0;
-    }
+	/* Start over with the next getopt call */
+	optind = 0;
 
-    return 1;
+	return ret;
 }
 
 
@@ -2571,6 +8190,12 @@ int main(int argc, char *argv[])
 
 	opterr = 0;
 
+	/* Notes are buffered by output_write */
+	atexit(output_flush);
+
+	/* Finish off status changes interrupted by a crash */
+	recover_status_journal();
+
 	/* This function is applied only if there's MARK_AS_DONE
 	 * property available in ~/.memorc
 	 */
@@ -2589,6 +8214,7 @@ int main(int argc, char *argv[])
 		{"search", required_argument, 0, 'f'},
 		{"regex", required_argument, 0, 'F'},
 		{"stdin", no_argument, 0, 'i'},
+		{"jobs", required_argument, 0, 'j'},
 		{"latest", required_argument, 0, 'l'},
 		{"set-done", required_argument, 0, 'm'},
 		{"set-undone", required_argument, 0, 'M'},
@@ -2596,6 +8222,7 @@ int main(int argc, char *argv[])
 		{"organize", no_argument, 0, 'O'},
 		{"path", no_argument, 0, 'p'},
 		{"postpone", no_argument, 0, 'P'},
+		{"query", required_argument, 0, 'q'},
 		{"delete-done", no_argument, 0, 'R'},
 		{"replace", required_argument, 0, 'r'},
 		{"list", no_argument, 0, 's'},
@@ -2603,13 +8230,27 @@ int main(int argc, char *argv[])
 		{"list-undone", no_argument, 0, 'T'},
 		{"help", no_argument, 0, 'h'},
 		{"version", no_argument, 0, 'V'},
+		{"any", no_argument, 0, OPT_ANY},
+		{"all", no_argument, 0, OPT_ALL},
+		{"fuzzy", required_argument, 0, OPT_FUZZY},
+		{"rank", optional_argument, 0, OPT_RANK},
+		{"format", required_argument, 0, OPT_FORMAT},
+		{"count", no_argument, 0, OPT_COUNT},
+		{"exists", no_argument, 0, OPT_EXISTS},
+		{"offset", required_argument, 0, OPT_OFFSET},
+		{"limit", required_argument, 0, OPT_LIMIT},
 		{0, 0, 0, 0}
 	};
 
 	/* getopt_long stores the option index here. */
 	int option_index = 0;
 
-	while ((c = getopt_long(argc, argv, "a:d:De:f:F:hil:m:M:oOpPr:RsTuV", long_options, &option_index)) != -1){
+	if (read_modifier_options(argc, argv, long_options) == -1) {
+		free(path);
+		return -1;
+	}
+
+	while ((c = getopt_long(argc, argv, "a:d:De:f:F:hij:l:m:M:oOpPq:r:RsTuV", long_options, &option_index)) != -1){
 		has_valid_options = 1;
 
 		switch(c) {
@@ -2674,6 +8315,9 @@ int main(int argc, char *argv[])
 			else
 				show_notes(POSTPONED);
 			break;
+		case 'q':
+			query_notes(optarg);
+			break;
 		case 'r': {
 			int id = atoi(optarg);
 			if (argv[optind]) {
@@ -2701,6 +8345,18 @@ int main(int argc, char *argv[])
 		case 'V':
 			printf("Memo version %s\n", VERSION);
 			break;
+		case 'j':
+		case OPT_ANY:
+		case OPT_ALL:
+		case OPT_FUZZY:
+		case OPT_RANK:
+		case OPT_FORMAT:
+		case OPT_COUNT:
+		case OPT_EXISTS:
+		case OPT_OFFSET:
+		case OPT_LIMIT:
+			/* Already handled by read_modifier_options */
+			break;
 		case '?':
 			if (optopt == 'a')
 				printf("-a missing an argument <content>\n");
@@ -2712,18 +8368,33 @@ int main(int argc, char *argv[])
 				printf("-f missing an argument <search>\n");
 			else if (optopt == 'F')
 				printf("-F missing an argument <regex>\n");
+			else if (optopt == 'j')
+				printf("-j missing an argument <n>\n");
 			else if (optopt == 'l')
 				printf("-l missing an argument <n>\n");
 			else if (optopt == 'm')
 				printf("-m missing an argument <id>\n");
 			else if(optopt == 'M')
 				printf("-M missing an argument <id>\n");
+			else if(optopt == 'q')
+				printf("-q missing an argument <query>\n");
 			else if(optopt == 'r')
 				printf("-r missing an argument <id>\n");
+			else if(optopt == OPT_FUZZY)
+				printf("--fuzzy missing an argument <k>\n");
+			else if(optopt == OPT_FORMAT)
+				printf("--format missing an argument <format>\n");
+			else if(optopt == OPT_OFFSET)
+				printf("--offset missing an argument <k>\n");
+			else if(optopt == OPT_LIMIT)
+				printf("--limit missing an argument <n>\n");
 			else
 				printf("invalid option, see memo -h for help\n");
 			break;
 		}
+
+		/* Keep the output of each option in order */
+		output_flush();
 	}
 
 	if (organize_note_ids)
@@ -2747,5 +8418,10 @@ int main(int argc, char *argv[])
 
 	free(path);
 
+	if (memo_opts.count_mode == COUNT_NOTES)
+		printf("%zu\n", output_page.shown);
+	else if (memo_opts.count_mode == COUNT_EXISTS)
+		return output_page.shown > 0 ? 0 : 1;
+
 	return 0;
 }
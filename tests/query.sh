@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Tests of the id ranges of -q queries, including the ranges which
+# can't match anything. Run with make check.
+
+memo=${MEMO:-./memo}
+dir=$(mktemp -d) || exit 1
+failed=0
+
+trap 'rm -rf "$dir"' EXIT
+
+printf '1\tU\t2020-01-01\tfirst\n2\tD\t2020-01-02\tsecond\n3\tU\t2020-01-03\tthird\n' \
+	> "$dir/.memo"
+
+# check <expected count of notes> <query>
+check()
+{
+	got=$(HOME="$dir" XDG_CONFIG_HOME="$dir" "$memo" -q "$2" | wc -l)
+
+	if [ "$got" -ne "$1" ]; then
+		echo "FAIL: memo -q '$2' found $got notes, expected $1"
+		failed=1
+	fi
+}
+
+check 0 'id<0'
+check 1 'id<=1'
+check 1 'id<2'
+check 3 'id>=0'
+check 3 'id>0'
+check 1 'id>2'
+check 0 'id>3'
+check 3 'id<=4294967295'
+check 0 'id>4294967295'
+check 0 'id>=4294967295'
+check 0 'id<0 id>0'
+check 1 'id>1 id<3'
+check 0 'id>2 id<3'
+check 2 'status:U id>=0'
+
+if [ "$failed" -eq 0 ]; then
+	echo "query: all tests passed"
+fi
+
+exit $failed